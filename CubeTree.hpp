@@ -4,106 +4,694 @@
 #include "vendor/glm/glm/glm.hpp"
 #include <vector>
 #include <mutex>
+#include <shared_mutex>
 #include <sstream>
 #include <iostream>
 #include <memory>
 #include <cmath>
 #include <limits>
 #include <queue>
+#include <unordered_map>
+#include <stdexcept>
+#include <span>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <concepts>
+#include <iterator>
+#include <type_traits>
+#include <bitset>
+#include <bit>
+#include <array>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include "ThreadPool.hpp"
+#include "NodePool.hpp"
+#include "RangeKernel.hpp"
+#include "SmallVector.hpp"
 
-template<std::uint8_t N, std::uint16_t MaxT, typename T, typename FType = double>
+// Compile-time switches for CubeTree, derive from this and shadow a member to change it
+struct CubeTreeOptions {
+    // Mirror the leaf positions into per-axis arrays and test them with RangeKernel in queryRange
+    static constexpr bool soaLeaves{false};
+
+    // Loose mode for entities with extents: every entity has a bounding radius (m_radius) and is stored
+    // in the deepest node whose box, inflated by looseness, still contains its whole sphere. Entities
+    // then move inside the slack without being reinserted. Queries keep testing entity positions
+    static constexpr bool loose{false};
+    static constexpr double looseness{2.0};
+
+    // Compact nodes for very large trees: only the present children are stored, behind a bitmask,
+    // node locks come from a striped table owned by the tree and up to MaxT entries are kept
+    // inline without a heap allocation. Visitors must not query the tree they are called from
+    static constexpr bool compactNodes{false};
+
+    // Only entities passed to markMoved or move since the last update are looked at by update,
+    // instead of comparing the position of every entity of the tree
+    static constexpr bool markedMoves{false};
+
+    // Count queries, node visits, splits, root growths, reinserts, update tasks and time spent
+    // waiting for node locks, read back with CubeTree::stats. Nothing is counted when off
+    static constexpr bool stats{false};
+
+    // Integer node coordinates: positions are quantized to a grid laid over the first root box and
+    // every node is a level and the integer corner of its cell, so child selection and containment
+    // are exact integer operations on half-open cells and a node box takes 16 bytes. Needs a power
+    // of two N and no loose mode; positions finer than the grid share a cell
+    static constexpr bool fixedPoint{false};
+
+    // Keep the moves of the last update and count inserts and removes, so a CubeTreeQueryCache can
+    // tell whether its cached answers still hold without querying the tree again
+    static constexpr bool queryCache{false};
+
+    // Axes the nodes split along: 3, or 2 for maps in the xy plane, where every node has N^2
+    // children and its box bounds x and y only. Entities keep their z, distances still use it
+    static constexpr std::uint8_t dimensions{3};
+};
+
+// How CubeTree stores and reads entities. Handle is what a node keeps per entity, Key its identity
+// in the entity map and Ref what the raw query overloads write out. This default works for any
+// pointer-like Handle (std::shared_ptr<T> or T*) to objects with m_position and m_prevPosition,
+// m_name for printTree and m_radius in loose mode. Write another traits class to store indices
+// into external position arrays or entities by value
+template<typename T, typename H = std::shared_ptr<T>>
+struct EntityTraits {
+    typedef H Handle;
+    typedef const T* Key;
+    typedef T* Ref;
+
+    static const auto& position(const Handle& entity) { return entity->m_position; }
+    static const auto& prevPosition(const Handle& entity) { return entity->m_prevPosition; }
+    static const auto& name(const Handle& entity) { return entity->m_name; }
+    static auto radius(const Handle& entity) { return entity->m_radius; }
+
+    // Records the current position as the one the entity is stored under
+    static void settle(Handle& entity) { entity->m_prevPosition = entity->m_position; }
+
+    template<typename Vec>
+    static void setPosition(const Handle& entity, const Vec& pos) { entity->m_position = pos; }
+
+    static Key key(const Handle& entity) { return &*entity; }
+    static Ref ref(const Handle& entity) { return &*entity; }
+};
+
+template<std::uint8_t N, std::uint16_t MaxT, typename T, typename FType = double, template<typename> class NodeAllocator = NodePool, typename Options = CubeTreeOptions, typename Traits = EntityTraits<T>>
 class CubeTree {
+public:
+    // What the tree stores per entity and the identity its entity map is keyed by
+    typedef typename Traits::Handle Handle;
+    typedef typename Traits::Key Key;
+
+    // Axes the nodes split along, the child slots along z (one in 2D) and the child slots of a node
+    static constexpr glm::length_t Axes{Options::dimensions};
+    static constexpr std::uint8_t NZ{(Options::dimensions == 2) ? static_cast<std::uint8_t>(1) : N};
+    static constexpr std::size_t Slots{static_cast<std::size_t>(N) * N * NZ};
+
+private:
+    static_assert(Options::dimensions == 2 || Options::dimensions == 3, "CubeTree needs 2 or 3 dimensions!");
+    static_assert(!Options::loose || Options::looseness > 1, "Loose mode needs a looseness above 1!");
+    static_assert(!Options::fixedPoint || (std::has_single_bit(static_cast<unsigned>(N)) && N >= 2), "Fixed point mode needs a power of two N!");
+    static_assert(!Options::fixedPoint || !Options::loose, "Fixed point mode does not support loose mode!");
+
+    // Grid of Options::fixedPoint: a level-L node is N^L cells long and the first root sits at
+    // RootLevel, about 2^20 cells across. Cells are addressed with 32 bits, so the root may grow
+    // until it is 2^31 cells long at MaxLevel
+    static constexpr std::uint32_t LevelBits{static_cast<std::uint32_t>(std::bit_width(static_cast<unsigned>(N)) - 1)};
+    static constexpr std::uint32_t RootLevel{(LevelBits == 0) ? 0 : 20 / LevelBits};
+    static constexpr std::uint32_t MaxLevel{(LevelBits == 0) ? 0 : 31 / LevelBits};
+
 public:
     typedef struct BBox {
         glm::vec<3, FType, glm::defaultp> center;
         FType length;
     } BBox;
 
+    // Node box of Options::fixedPoint: the level and the integer corner of the cell
+    typedef struct Cell {
+        std::int32_t x, y, z;
+        std::uint8_t level;
+    } Cell;
+
+    typedef std::conditional_t<Options::fixedPoint, Cell, BBox> NodeBox;
+
+    // Snapshot of the counters kept with Options::stats
+    typedef struct Stats {
+        std::uint64_t queries;          // range, shape, nearest and ray queries run
+        std::uint64_t nodesVisited;     // nodes those queries looked into
+        std::uint64_t entitiesTested;   // entries those queries tested
+        std::uint64_t splits;           // leaves turned into inner nodes
+        std::uint64_t growths;          // levels the root grew by in insert
+        std::uint64_t reinserted;       // entities update took out of their node and put back
+        std::uint64_t collectTasks;     // tasks update scheduled to collect movers
+        std::uint64_t lockWaitNanos;    // time spent blocked on node locks
+    } Stats;
+
+    // Live counters behind Stats, updated with relaxed atomics
+    struct Counters {
+        std::atomic<std::uint64_t> queries{0}, nodesVisited{0}, entitiesTested{0}, splits{0}, growths{0}, reinserted{0}, collectTasks{0}, lockWaitNanos{0};
+    };
+
+    // Stand-in when Options::stats is off, takes no space in the context
+    struct NoCounters {};
+
+    // An entity update found moved, from the position it was stored under to its new one
+    typedef struct Move {
+        glm::vec<3, FType, glm::defaultp> from, to;
+    } Move;
+
+    // What Options::queryCache keeps, read back with CubeTree::moveLog
+    struct MoveLog {
+        std::vector<Move> moves;                // moves found by the last update
+        std::uint64_t updates{0};               // updates run so far
+        std::atomic<std::uint64_t> edits{0};    // inserts and removes, update growing the root included
+    };
+
+    struct NoMoveLog {};
+
+    // Work of a single query, added to the counters once when the query is done
+    struct QueryTally {
+        std::uint64_t nodes{0}, entities{0};
+    };
+
+    // State shared by every node of one tree, owned by the topmost node
+    struct Context {
+        static constexpr std::size_t Stripes{64};
+
+        // Every node below the topmost one is allocated here
+        NodeAllocator<CubeTree> nodes;
+
+        // Levels the root has grown by since construction, compact gives them back once unused
+        std::uint32_t grown{0};
+
+        // Options::fixedPoint grid: the world position of cell 0 and the length of one cell
+        glm::vec<3, FType, glm::defaultp> origin{};
+        FType unit{1};
+
+        // Entity to leaf back-references, striped so concurrent inserts rarely share a lock
+        struct Stripe {
+            std::shared_mutex mtx;
+            std::unordered_map<Key, CubeTree*> leaves;
+        } stripes[Stripes];
+
+        Stripe& stripe(const Key& entity) {
+            const std::size_t h{std::hash<Key>{}(entity)};
+            return stripes[(h ^ (h >> 4) ^ (h >> 11)) % Stripes];
+        }
+
+        void locate(const Handle& entity, CubeTree* leaf) {
+            const Key key{Traits::key(entity)};
+            Stripe& s{stripe(key)};
+            std::lock_guard<std::shared_mutex> lock(s.mtx);
+            s.leaves[key] = leaf;
+        }
+
+        CubeTree* find(const Key& entity) {
+            Stripe& s{stripe(entity)};
+            std::shared_lock<std::shared_mutex> lock(s.mtx);
+            const auto it{s.leaves.find(entity)};
+            return (it != s.leaves.end()) ? it->second : nullptr;
+        }
+
+        // Presizes the maps for about count entities so bulk inserts do not rehash repeatedly
+        void reserve(const std::size_t& count) {
+            for(auto& s : stripes) {
+                std::lock_guard<std::shared_mutex> lock(s.mtx);
+                s.leaves.reserve(s.leaves.size() + count / Stripes + 1);
+            }
+        }
+
+        void forget(const Key& entity) {
+            Stripe& s{stripe(entity)};
+            std::lock_guard<std::shared_mutex> lock(s.mtx);
+            s.leaves.erase(entity);
+        }
+
+        // Entities marked as moved since the last update, every thread appends to the list its id hashes to
+        static constexpr std::size_t MoveLists{Options::markedMoves ? 16 : 1};
+        struct MoveList {
+            std::mutex mtx;
+            std::vector<Handle> handles;
+        } moved[MoveLists];
+
+        void mark(const Handle& entity) {
+            MoveList& list{moved[std::hash<std::thread::id>()(std::this_thread::get_id()) % MoveLists]};
+            std::lock_guard<std::mutex> lock(list.mtx);
+            list.handles.push_back(entity);
+        }
+
+        // Empties every list into one
+        std::vector<Handle> takeMoved() {
+            std::vector<Handle> all;
+            for(auto& list : moved) {
+                std::lock_guard<std::mutex> lock(list.mtx);
+                if(all.empty()) all.swap(list.handles);
+                else all.insert(all.end(), std::make_move_iterator(list.handles.begin()), std::make_move_iterator(list.handles.end()));
+                list.handles.clear();
+            }
+            return all;
+        }
+
+        // Node locks of compact nodes, every node uses the one its address hashes to
+        static constexpr std::size_t NodeLocks{Options::compactNodes ? 256 : 1};
+        std::shared_mutex locks[NodeLocks];
+
+        std::shared_mutex& lockFor(const CubeTree* node) {
+            const std::size_t h{reinterpret_cast<std::uintptr_t>(node) / alignof(CubeTree)};
+            return locks[(h ^ (h >> 8)) % NodeLocks];
+        }
+
+        [[no_unique_address]] std::conditional_t<Options::stats, Counters, NoCounters> counters;
+
+        // Adds amount to one of the counters, compiles to nothing without Options::stats
+        void tally(std::atomic<std::uint64_t> Counters::* counter, const std::uint64_t& amount = 1) {
+            if constexpr (Options::stats) (counters.*counter).fetch_add(amount, std::memory_order_relaxed);
+        }
+
+        void tally(const QueryTally& query, const std::uint64_t& queries = 1) {
+            tally(&Counters::queries, queries);
+            tally(&Counters::nodesVisited, query.nodes);
+            tally(&Counters::entitiesTested, query.entities);
+        }
+
+        [[no_unique_address]] std::conditional_t<Options::queryCache, MoveLog, NoMoveLog> log;
+
+        // Adds the moves one update task found, callers serialize
+        void logMoves(const std::vector<Move>& moves) {
+            if constexpr (Options::queryCache) log.moves.insert(log.moves.end(), moves.begin(), moves.end());
+        }
+
+        void edited() {
+            if constexpr (Options::queryCache) log.edits.fetch_add(1, std::memory_order_relaxed);
+        }
+    };
+
+    // Child pointers of a node, one slot for each of the N^3 (N^2 in 2D) cells
+    struct ChildArray {
+        CubeTree* slots[N][N][NZ]{};
+
+        CubeTree* get(const std::uint8_t& i, const std::uint8_t& j, const std::uint8_t& k) const {
+            return slots[i][j][k];
+        }
+
+        void set(const std::uint8_t& i, const std::uint8_t& j, const std::uint8_t& k, CubeTree* child) {
+            slots[i][j][k] = child;
+        }
+    };
+
+    // Children of a compact node: a bitmask of the occupied slots and an array holding only those
+    // children in slot order, reallocated whenever a child is added or removed
+    struct PackedChildren {
+        std::conditional_t<(Slots <= 64), std::uint64_t, std::bitset<Slots>> mask{};
+        std::unique_ptr<CubeTree*[]> packed;
+
+        CubeTree* get(const std::uint8_t& i, const std::uint8_t& j, const std::uint8_t& k) const {
+            const std::size_t slot{(static_cast<std::size_t>(i) * N + j) * NZ + k};
+            return test(slot) ? packed[rank(slot)] : nullptr;
+        }
+
+        void set(const std::uint8_t& i, const std::uint8_t& j, const std::uint8_t& k, CubeTree* child) {
+            const std::size_t slot{(static_cast<std::size_t>(i) * N + j) * NZ + k};
+            const std::size_t index{rank(slot)}, count{rank(Slots)};
+            if(test(slot)) {
+                if(child != nullptr) {
+                    packed[index] = child;
+                    return;
+                }
+                std::unique_ptr<CubeTree*[]> shrunk{(count > 1) ? new CubeTree*[count - 1] : nullptr};
+                std::copy(packed.get(), packed.get() + index, shrunk.get());
+                std::copy(packed.get() + index + 1, packed.get() + count, shrunk.get() + index);
+                packed = std::move(shrunk);
+                flip(slot);
+            } else if(child != nullptr) {
+                std::unique_ptr<CubeTree*[]> grown{new CubeTree*[count + 1]};
+                std::copy(packed.get(), packed.get() + index, grown.get());
+                grown[index] = child;
+                std::copy(packed.get() + index, packed.get() + count, grown.get() + index + 1);
+                packed = std::move(grown);
+                flip(slot);
+            }
+        }
+
+    private:
+        const bool test(const std::size_t& slot) const {
+            if constexpr (Slots <= 64) return ((mask >> slot) & 1u) != 0;
+            else return mask.test(slot);
+        }
+
+        void flip(const std::size_t& slot) {
+            if constexpr (Slots <= 64) mask ^= std::uint64_t{1} << slot;
+            else mask.flip(slot);
+        }
+
+        // Number of occupied slots below slot
+        const std::size_t rank(const std::size_t& slot) const {
+            if constexpr (Slots <= 64) return static_cast<std::size_t>(std::popcount((slot == 64) ? mask : mask & ((std::uint64_t{1} << slot) - 1)));
+            else return (slot == Slots) ? mask.count() : (mask << (Slots - slot)).count();
+        }
+    };
+
+    // Stand-in for the per-node lock of compact nodes, takes no space in the node
+    struct NoMutex {};
+
+    // Per-axis copy of the leaf positions as of their last insert or update, kept index aligned with data
+    struct Positions {
+        std::vector<FType> x, y, z;
+
+        void push(const glm::vec<3, FType, glm::defaultp>& pos) {
+            x.push_back(pos.x);
+            y.push_back(pos.y);
+            z.push_back(pos.z);
+        }
+
+        void set(const std::size_t& index, const glm::vec<3, FType, glm::defaultp>& pos) {
+            x[index] = pos.x;
+            y[index] = pos.y;
+            z[index] = pos.z;
+        }
+
+        void erase(const std::size_t& index) {
+            x[index] = x.back();
+            y[index] = y.back();
+            z[index] = z.back();
+            x.pop_back();
+            y.pop_back();
+            z.pop_back();
+        }
+
+        void clear() {
+            x.clear();
+            y.clear();
+            z.clear();
+            x.shrink_to_fit();
+            y.shrink_to_fit();
+            z.shrink_to_fit();
+        }
+    };
+
+    // Stand-in when Options::soaLeaves is off, takes no space in the node
+    struct NoPositions {
+        void push(const glm::vec<3, FType, glm::defaultp>&) {}
+        void set(const std::size_t&, const glm::vec<3, FType, glm::defaultp>&) {}
+        void erase(const std::size_t&) {}
+        void clear() {}
+    };
+
     CubeTree* parent;
-    CubeTree* children[N][N][N];
-    std::mutex mtx;
-    std::vector<std::shared_ptr<T>> data;
-    BBox box;
+    std::conditional_t<Options::compactNodes, PackedChildren, ChildArray> children;
+    [[no_unique_address]] std::conditional_t<Options::compactNodes, NoMutex, std::shared_mutex> mtx;
+    std::conditional_t<Options::compactNodes, SmallVector<Handle, MaxT>, std::vector<Handle>> data;
+    NodeBox box;
+    std::uint32_t childCount;
+    Context* context;
+    [[no_unique_address]] std::conditional_t<Options::soaLeaves, Positions, NoPositions> positions;
 
     // Constructor for a new tree node
-    CubeTree(const BBox& box, std::shared_ptr<T> data) :
-        parent(nullptr), children{nullptr}, box(box) {
-        if(insert(data) != this) throw std::exception("Initial data entry not within node!");
-    }
-
-    // Constructor for creating a new parent node
-    CubeTree(CubeTree* child) :
-        parent(nullptr), children{nullptr}, box({
-            child->box.center,
-            pow(child->box.length, 2)  // Square the length to ensure child fits within the new parent
-        }) {
-        children[(child->box.center.x < box.center.x) ? 0 : N - 1][(child->box.center.y < box.center.y) ? 0 : N - 1][(child->box.center.z < box.center.z) ? 0 : N - 1] = child;
+    CubeTree(const BBox& box, Handle data) :
+        parent(nullptr), children{}, box(rootBox(box)), childCount(0), context(nullptr) {
+        if(!fits(box, data)) throw std::invalid_argument("Initial data entry not within node!");
+        context = new Context();
+        adoptGrid(box);
+        if(!holds(data)) {
+            delete context;
+            throw std::invalid_argument("Initial data entry not within node!");
+        }
+        store(data);
     }
 
     ~CubeTree() {
-        for(std::uint8_t i{0}; i < N; i++) {
-            for(std::uint8_t j{0}; j < N; j++) {
-                for(std::uint8_t k{0}; k < N; k++) {
-                    CubeTree* child = children[i][j][k];
-                    if(child != nullptr) {
-                        delete child;
-                        child = nullptr;
-                    }
-                }
-            }
+        // Only the topmost node tears the tree down, every other node goes back to the allocator
+        if(parent != nullptr) return;
+        std::vector<CubeTree*> pending;
+        pushChildren(pending);
+        while(!pending.empty()) {
+            CubeTree* node{pending.back()};
+            pending.pop_back();
+            node->pushChildren(pending);
+            context->nodes.destroy(node);
         }
+        delete context;
     }
 
     static const bool inside(const BBox& box, const glm::vec<3, FType, glm::defaultp>& pos) {
         const FType halfBl{box.length / 2};
         return (pos.x >= (box.center.x - halfBl) && pos.x <= (box.center.x + halfBl)) &&
             (pos.y >= (box.center.y - halfBl) && pos.y <= (box.center.y + halfBl)) &&
-            (pos.z >= (box.center.z - halfBl) && pos.z <= (box.center.z + halfBl));
+            (Axes == 2 || (pos.z >= (box.center.z - halfBl) && pos.z <= (box.center.z + halfBl)));
     }
 
-    CubeTree* findParentNode(const std::shared_ptr<T>& entity) {
-        // Start searching from the root node
-        return findParentNodeRecursive(this, entity);
+    // Box every entry of a node with the given box lies in, inflated by the looseness in loose mode
+    static const BBox bounds(const BBox& box) {
+        if constexpr (Options::loose) return {box.center, box.length * static_cast<FType>(Options::looseness)};
+        else return box;
     }
 
-    private:
-    CubeTree* findParentNodeRecursive(CubeTree* node, const std::shared_ptr<T>& entity) {
-        if (!node) return nullptr;
+    // Whether entity may be stored in a node with the given box: its position is inside the box,
+    // or in loose mode its whole bounding sphere is inside the inflated box
+    static const bool fits(const BBox& box, const Handle& entity) {
+        if constexpr (Options::loose) {
+            const FType reach{bounds(box).length / 2 - static_cast<FType>(Traits::radius(entity))};
+            const auto& pos{Traits::position(entity)};
+            return std::abs(pos.x - box.center.x) <= reach && std::abs(pos.y - box.center.y) <= reach && (Axes == 2 || std::abs(pos.z - box.center.z) <= reach);
+        }
+        else {
+            return inside(box, Traits::position(entity));
+        }
+    }
+
+    // Node box of a root covering box, in fixed point mode the root cell of the grid
+    static const NodeBox rootBox(const BBox& box) {
+        if constexpr (Options::fixedPoint) return {0, 0, 0, static_cast<std::uint8_t>(RootLevel)};
+        else return box;
+    }
+
+    // Length of a node of the given level in grid cells
+    static constexpr std::int64_t cellsAt(const std::uint32_t& level) {
+        return std::int64_t{1} << (LevelBits * level);
+    }
 
-        // Lock the current node
-        std::lock_guard<std::mutex> lock(node->mtx);
+    // Lays the fixed point grid over the box of a new topmost node
+    void adoptGrid(const BBox& box) {
+        if constexpr (Options::fixedPoint) {
+            context->origin = box.center - glm::vec<3, FType, glm::defaultp>(box.length / 2);
+            context->unit = box.length / static_cast<FType>(cellsAt(RootLevel));
+        }
+    }
 
-        // Check if the entity is in the current node
-        for (const auto& data : node->data) {
-            if (data == entity) {
-                return node->parent;
+    // Grid cell of pos, false (and q saturated) when pos lies outside the 32-bit grid. In 2D the
+    // z cell is always 0
+    const bool quantize(const glm::vec<3, FType, glm::defaultp>& pos, std::int64_t (&q)[3]) const {
+        bool valid{true};
+        q[2] = 0;
+        for(glm::length_t axis{0}; axis < Axes; axis++) {
+            const FType scaled{std::floor((pos[axis] - context->origin[axis]) / context->unit)};
+            if(scaled >= static_cast<FType>(-2147483648.0) && scaled < static_cast<FType>(2147483648.0)) {
+                q[axis] = static_cast<std::int64_t>(scaled);
+            } else {
+                q[axis] = (scaled > 0) ? std::int64_t{INT32_MAX} + 1 : std::int64_t{INT32_MIN} - 1;
+                valid = false;
             }
         }
+        return valid;
+    }
 
-        // Recursively search the children
-        for (std::uint8_t i = 0; i < N; ++i) {
-            for (std::uint8_t j = 0; j < N; ++j) {
-                for (std::uint8_t k = 0; k < N; ++k) {
-                    if (node->children[i][j][k] != nullptr) {
-                        CubeTree* parentNode = findParentNodeRecursive(node->children[i][j][k], entity);
-                        if (parentNode) return parentNode;
-                    }
-                }
+    // Whether entity belongs in this node, see fits. In fixed point mode its grid cell has to lie in
+    // the half-open cell of the node, so a point on a shared face belongs to exactly one node
+    const bool holds(const Handle& entity) const {
+        if constexpr (Options::fixedPoint) {
+            std::int64_t q[3];
+            if(!quantize(Traits::position(entity), q)) return false;
+            const std::int64_t size{cellsAt(box.level)};
+            const std::int64_t offset[3]{q[0] - box.x, q[1] - box.y, q[2] - box.z};
+            return offset[0] >= 0 && offset[0] < size && offset[1] >= 0 && offset[1] < size && (Axes == 2 || (offset[2] >= 0 && offset[2] < size));
+        }
+        else {
+            return fits(box, entity);
+        }
+    }
+
+    // Box of this node in world coordinates. In fixed point mode it is widened by a cell on every
+    // side so positions that quantize rounded into the node are covered
+    const BBox worldBox() const {
+        if constexpr (Options::fixedPoint) {
+            const FType length{static_cast<FType>(cellsAt(box.level)) * context->unit};
+            const glm::vec<3, FType, glm::defaultp> corner{static_cast<FType>(box.x), static_cast<FType>(box.y), static_cast<FType>(box.z)};
+            return {context->origin + corner * context->unit + glm::vec<3, FType, glm::defaultp>(length / 2), length + 2 * context->unit};
+        }
+        else {
+            return box;
+        }
+    }
+
+    // Index of the child covering `coord` along one axis, clamped so points on the outer faces
+    // (or pushed out by rounding) still land in the first or last slot
+    static const std::uint8_t childSlot(const FType& coord, const FType& center, const FType& length) {
+        if constexpr (N == 2) {
+            return (coord < center) ? 0 : 1;
+        }
+        else {
+            const FType scaled{(coord - (center - length / 2)) * (static_cast<FType>(N) / length)};
+            if(!(scaled > 0)) return 0;
+            if(scaled >= static_cast<FType>(N - 1)) return N - 1;
+            return static_cast<std::uint8_t>(scaled);
+        }
+    }
+
+    // Child slots covering pos along the three axes, clamped to the node like childSlot. The z slot
+    // is always 0 in 2D
+    const std::array<std::uint8_t, 3> slotOf(const glm::vec<3, FType, glm::defaultp>& pos) const {
+        if constexpr (Options::fixedPoint) {
+            std::int64_t q[3];
+            quantize(pos, q);
+            const std::uint32_t shift{LevelBits * (box.level - 1u)};
+            const std::int64_t corner[3]{box.x, box.y, box.z};
+            std::array<std::uint8_t, 3> slot{};
+            for(glm::length_t axis{0}; axis < Axes; axis++) slot[axis] = static_cast<std::uint8_t>(std::clamp<std::int64_t>((q[axis] - corner[axis]) >> shift, 0, N - 1));
+            return slot;
+        }
+        else {
+            return {childSlot(pos.x, box.center.x, box.length), childSlot(pos.y, box.center.y, box.length), (Axes == 2) ? std::uint8_t{0} : childSlot(pos.z, box.center.z, box.length)};
+        }
+    }
+
+    // Bounding box of the child in slot [i][j][k]
+    const NodeBox childBox(const std::uint8_t& i, const std::uint8_t& j, const std::uint8_t& k) const {
+        if constexpr (Options::fixedPoint) {
+            const std::int64_t childCells{cellsAt(box.level - 1u)};
+            return {static_cast<std::int32_t>(box.x + childCells * i), static_cast<std::int32_t>(box.y + childCells * j), static_cast<std::int32_t>(box.z + childCells * k), static_cast<std::uint8_t>(box.level - 1)};
+        }
+        else {
+            const FType childLength{box.length / N};
+            const FType halfBl{box.length / 2};
+            return {
+                {
+                    box.center.x - halfBl + childLength * (static_cast<FType>(i) + static_cast<FType>(0.5)),
+                    box.center.y - halfBl + childLength * (static_cast<FType>(j) + static_cast<FType>(0.5)),
+                    (Axes == 2) ? box.center.z : box.center.z - halfBl + childLength * (static_cast<FType>(k) + static_cast<FType>(0.5))
+                },
+                childLength
+            };
+        }
+    }
+
+    // Position of entity as the tree reads it
+    static decltype(auto) positionOf(const Handle& entity) {
+        return Traits::position(entity);
+    }
+
+    // Leaf currently holding entity, or nullptr if it is not in the tree
+    CubeTree* findNode(const Handle& entity) const {
+        return context->find(Traits::key(entity));
+    }
+
+    CubeTree* findParentNode(const Handle& entity) const {
+        CubeTree* node{findNode(entity)};
+        return (node != nullptr) ? node->parent : nullptr;
+    }
+
+    // Lock guarding the entries and children of this node, taken from the tree's table for compact nodes
+    std::shared_mutex& mutex() {
+        if constexpr (Options::compactNodes) return context->lockFor(this);
+        else return mtx;
+    }
+
+    // Takes the node lock exclusively or shared. With Options::stats a lock that is not free right
+    // away is waited for on the clock
+    std::unique_lock<std::shared_mutex> exclusiveLock() {
+        if constexpr (Options::stats) {
+            std::unique_lock<std::shared_mutex> lock(mutex(), std::try_to_lock);
+            if(!lock.owns_lock()) {
+                const auto start{std::chrono::steady_clock::now()};
+                lock.lock();
+                context->tally(&Counters::lockWaitNanos, static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()));
+            }
+            return lock;
+        } else {
+            return std::unique_lock<std::shared_mutex>(mutex());
+        }
+    }
+
+    std::shared_lock<std::shared_mutex> sharedLock() {
+        if constexpr (Options::stats) {
+            std::shared_lock<std::shared_mutex> lock(mutex(), std::try_to_lock);
+            if(!lock.owns_lock()) {
+                const auto start{std::chrono::steady_clock::now()};
+                lock.lock();
+                context->tally(&Counters::lockWaitNanos, static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()));
             }
+            return lock;
+        } else {
+            return std::shared_lock<std::shared_mutex>(mutex());
         }
+    }
 
-        // If the entity is not found in this subtree, return nullptr
-        return nullptr;
+    // Box of this node read under its shared lock, a concurrent insert may be growing the root in place
+    const BBox lockedBox() {
+        const auto lock{sharedLock()};
+        return worldBox();
+    }
+
+    // Function to read the counters of this tree, only with Options::stats
+    const Stats stats() const requires Options::stats {
+        const Counters& c{context->counters};
+        return {c.queries.load(std::memory_order_relaxed), c.nodesVisited.load(std::memory_order_relaxed), c.entitiesTested.load(std::memory_order_relaxed),
+            c.splits.load(std::memory_order_relaxed), c.growths.load(std::memory_order_relaxed), c.reinserted.load(std::memory_order_relaxed),
+            c.collectTasks.load(std::memory_order_relaxed), c.lockWaitNanos.load(std::memory_order_relaxed)};
+    }
+
+    void resetStats() requires Options::stats {
+        Counters& c{context->counters};
+        for(auto* counter : {&c.queries, &c.nodesVisited, &c.entitiesTested, &c.splits, &c.growths, &c.reinserted, &c.collectTasks, &c.lockWaitNanos}) counter->store(0, std::memory_order_relaxed);
+    }
+
+    // Nodes, leaves and entries found at one depth
+    typedef struct Level {
+        std::size_t nodes;
+        std::size_t leaves;
+        std::size_t entries;
+    } Level;
+
+    // Shape of the tree: levels[d] describes depth d below this node and occupancy[n] counts the
+    // leaves holding n entries, the last slot the ones holding more than MaxT
+    typedef struct Histogram {
+        std::vector<Level> levels;
+        std::vector<std::size_t> occupancy;
+    } Histogram;
+
+    // Function to describe the depth and occupancy of the subtree below this node, the structured
+    // counterpart of printTree. Works with or without Options::stats
+    Histogram histogram() {
+        Histogram result{{}, std::vector<std::size_t>(static_cast<std::size_t>(MaxT) + 2)};
+        std::vector<std::pair<CubeTree*, std::size_t>> pending{{this, 0}};
+        while(!pending.empty()) {
+            const auto [node, depth]{pending.back()};
+            pending.pop_back();
+            CubeTree* next[Slots];
+            std::size_t count, entries;
+            {
+                const auto lock{node->sharedLock()};
+                entries = node->data.size();
+                count = node->listChildren(next);
+            }
+            if(result.levels.size() <= depth) result.levels.resize(depth + 1, Level{0, 0, 0});
+            Level& level{result.levels[depth]};
+            level.nodes++;
+            level.entries += entries;
+            if(count == 0) {
+                level.leaves++;
+                result.occupancy[std::min(entries, static_cast<std::size_t>(MaxT) + 1)]++;
+            }
+            for(std::size_t index{0}; index < count; index++) pending.emplace_back(next[index], depth + 1);
+        }
+        return result;
     }
 
-    public:
     // Function to check if the current node has any children
     const bool isParent() const {
-        for(std::uint8_t i{0}; i < N; i++)
-            for(std::uint8_t j{0}; j < N; j++)
-                for(std::uint8_t k{0}; k < N; k++)
-                    if(children[i][j][k] != nullptr) return true;
-        return false;
+        return childCount != 0;
     }
 
     // Static function to print the tree structure
@@ -117,218 +705,985 @@ public:
 
         // Print current node information
         std::cout << indent << "Node at depth " << depth << ": " << node << std::endl;
-        std::cout << indent << "  Box Center: (" << node->box.center.x << ", " << node->box.center.y << ", " << node->box.center.z << ")" << std::endl;
-        std::cout << indent << "  Box Length: " << node->box.length << std::endl;
+        const BBox box{node->worldBox()};
+        std::cout << indent << "  Box Center: (" << box.center.x << ", " << box.center.y << ", " << box.center.z << ")" << std::endl;
+        std::cout << indent << "  Box Length: " << box.length << std::endl;
         std::cout << indent << "  Data Count: " << node->data.size() << std::endl;
 
         // Print the positions of the data in the current node
         for(const auto& obj : node->data) {
-            std::cout << indent << "  Data Name: (" << obj->m_name << ")" << std::endl;
-            std::cout << indent << "  Data Prev Position: (" << obj->m_prevPosition.x << ", " << obj->m_prevPosition.y << ", " << obj->m_prevPosition.z << ")" << std::endl;
-            std::cout << indent << "  Data Position: (" << obj->m_position.x << ", " << obj->m_position.y << ", " << obj->m_position.z << ")" << std::endl;
+            std::cout << indent << "  Data Name: (" << Traits::name(obj) << ")" << std::endl;
+            std::cout << indent << "  Data Prev Position: (" << Traits::prevPosition(obj).x << ", " << Traits::prevPosition(obj).y << ", " << Traits::prevPosition(obj).z << ")" << std::endl;
+            std::cout << indent << "  Data Position: (" << Traits::position(obj).x << ", " << Traits::position(obj).y << ", " << Traits::position(obj).z << ")" << std::endl;
         }
 
         // Print children recursively
         for(std::uint8_t i = 0; i < N; ++i) {
             for(std::uint8_t j = 0; j < N; ++j) {
-                for(std::uint8_t k = 0; k < N; ++k) {
-                    if(node->children[i][j][k] != nullptr) {
+                for(std::uint8_t k = 0; k < NZ; ++k) {
+                    if(node->children.get(i, j, k) != nullptr) {
                         std::cout << indent << "  Child [" << static_cast<int>(i) << "][" << static_cast<int>(j) << "][" << static_cast<int>(k) << "]:" << std::endl;
-                        printTree(node->children[i][j][k], depth + 1);
+                        printTree(node->children.get(i, j, k), depth + 1);
                     }
                 }
             }
         }
     }
 
-    static void collectAndRemove(CubeTree* node, std::vector<std::shared_ptr<T>>& toReinsert, std::atomic<std::uint16_t>& activeThreads, std::mutex& collectMutex) {
-        std::lock_guard<std::mutex> lock(node->mtx);
-        auto it{node->data.begin()};
-        while (it != node->data.end()) {
-            if((*it)->m_position != (*it)->m_prevPosition) {
-                toReinsert.push_back(*it);
-                it = node->data.erase(it);
-            } else {
-                ++it;
+    // An entity that left the box of the leaf it was stored in, together with that leaf
+    typedef std::pair<CubeTree*, Handle> Escaped;
+
+    // Departure test of a plain update, every mover stays in the tree
+    struct NoDeparture {
+        constexpr bool operator()(const Handle&) const { return false; }
+    };
+
+    // Takes a mover out of node for good when departs says it leaves the tree, it is settled and added to departed
+    template<typename D>
+    static const bool depart(CubeTree* node, const std::size_t& index, const D& departs, std::vector<Escaped>& departed) {
+        auto& data{node->data[index]};
+        if(!departs(std::as_const(data))) return false;
+        Traits::settle(data);
+        departed.emplace_back(node, data);
+        node->context->forget(Traits::key(data));
+        node->context->edited();
+        node->eraseAt(index);
+        return true;
+    }
+
+    // Settles movers that are still inside their leaf in place and removes the ones that left it
+    template<typename D>
+    static void collectAndRemove(CubeTree* node, std::vector<Escaped>& escaped, std::mutex& collectMutex, ThreadPool::TaskGroup& tasks, const D& departs, std::vector<Escaped>& departed) {
+        std::vector<Escaped> left, gone;
+        std::vector<Move> moves;
+        {
+            const auto lock{node->exclusiveLock()};
+            std::size_t index{0};
+            while (index < node->data.size()) {
+                auto& data{node->data[index]};
+                if(Traits::position(data) == Traits::prevPosition(data)) {
+                    index++;
+                    continue;
+                }
+                if constexpr (Options::queryCache) moves.push_back({Traits::prevPosition(data), Traits::position(data)});
+                if(depart(node, index, departs, gone)) continue;
+                if(node->holds(data)) {
+                    Traits::settle(data);
+                    node->positions.set(index, Traits::position(data));
+                    index++;
+                } else {
+                    left.emplace_back(node, data);
+                    node->eraseAt(index);
+                }
             }
         }
 
-        std::vector<std::future<void>> futures;
+        if(!left.empty() || !moves.empty() || !gone.empty()) {
+            std::lock_guard<std::mutex> guard(collectMutex);
+            escaped.insert(escaped.end(), std::make_move_iterator(left.begin()), std::make_move_iterator(left.end()));
+            departed.insert(departed.end(), std::make_move_iterator(gone.begin()), std::make_move_iterator(gone.end()));
+            node->context->logMoves(moves);
+        }
+
         for(std::uint8_t i = 0; i < N; i++) {
             for(std::uint8_t j = 0; j < N; j++) {
-                for(std::uint8_t k = 0; k < N; k++) {
-                    if(node->children[i][j][k] != nullptr) {
-                        {
-                            std::lock_guard<std::mutex> guard(collectMutex);
-                            activeThreads++;
-                        }
-                        futures.push_back(std::async(std::launch::async, [node, i, j, k, &toReinsert, &activeThreads, &collectMutex]() {
-                            collectAndRemove(node->children[i][j][k], toReinsert, activeThreads, collectMutex);
-                            {
-                                std::lock_guard<std::mutex> guard(collectMutex);
-                                activeThreads--;
-                            }
-                        }));
+                for(std::uint8_t k = 0; k < NZ; k++) {
+                    CubeTree* child{node->children.get(i, j, k)};
+                    if(child != nullptr) {
+                        node->context->tally(&Counters::collectTasks);
+                        tasks.run([child, &escaped, &collectMutex, &tasks, &departs, &departed]() {
+                            collectAndRemove(child, escaped, collectMutex, tasks, departs, departed);
+                        });
                     }
                 }
             }
         }
+    }
 
-        for(auto& future : futures) {
-            future.get();
-        }
+    // Function to queue entity for the next update, only needed with Options::markedMoves. Marking
+    // an entity that did not move, or more than once, is harmless. Must not run alongside update
+    void markMoved(const Handle& entity) requires Options::markedMoves {
+        context->mark(entity);
     }
 
-    static CubeTree* update(const std::uint16_t& threads, CubeTree* root) {
-        std::vector<std::shared_ptr<T>> toReinsert;
-        std::atomic<std::uint16_t> activeThreads{0};
-        std::mutex collectMutex;
+    // Function to set the position of entity and mark it as moved
+    void move(const Handle& entity, const glm::vec<3, FType, glm::defaultp>& pos) requires Options::markedMoves {
+        Traits::setPosition(entity, pos);
+        context->mark(entity);
+    }
+
+    // Settles the marked entities still inside their node in place and removes the ones that left it,
+    // the counterpart of collectAndRemove for Options::markedMoves
+    template<typename D>
+    static void collectMarked(Context* context, std::span<Handle> marked, std::vector<Escaped>& escaped, std::mutex& collectMutex, const D& departs, std::vector<Escaped>& departed) {
+        std::vector<Escaped> left, gone;
+        std::vector<Move> moves;
+        for(const auto& entity : marked) {
+            const Key key{Traits::key(entity)};
+            CubeTree* node{context->find(key)};
+            if(node == nullptr) continue;
+            const auto lock{node->exclusiveLock()};
+            // A duplicate mark finds the entity already settled or taken out of the node
+            const auto it{std::find_if(node->data.begin(), node->data.end(), [&key](const Handle& entry) { return Traits::key(entry) == key; })};
+            if(it == node->data.end()) continue;
+            const std::size_t index{static_cast<std::size_t>(it - node->data.begin())};
+            auto& data{node->data[index]};
+            if(Traits::position(data) == Traits::prevPosition(data)) continue;
+            if constexpr (Options::queryCache) moves.push_back({Traits::prevPosition(data), Traits::position(data)});
+            if(depart(node, index, departs, gone)) continue;
+            if(node->holds(data)) {
+                Traits::settle(data);
+                node->positions.set(index, Traits::position(data));
+            } else {
+                left.emplace_back(node, data);
+                node->eraseAt(index);
+            }
+        }
 
-        collectAndRemove(root, toReinsert, activeThreads, collectMutex);
+        if(!left.empty() || !moves.empty() || !gone.empty()) {
+            std::lock_guard<std::mutex> guard(collectMutex);
+            escaped.insert(escaped.end(), std::make_move_iterator(left.begin()), std::make_move_iterator(left.end()));
+            departed.insert(departed.end(), std::make_move_iterator(gone.begin()), std::make_move_iterator(gone.end()));
+            context->logMoves(moves);
+        }
+    }
 
-        while (activeThreads > 0) {
-            std::this_thread::yield();
+    // Compacts the parents of the nodes movers left, deepest first so that a node is never visited
+    // after compacting one of its ancestors released it, then gives back unused root growth
+    static void compactAround(CubeTree* root, const std::vector<Escaped>& escaped) {
+        std::vector<std::pair<std::size_t, CubeTree*>> parents;
+        parents.reserve(escaped.size());
+        for(const auto& [origin, data] : escaped) {
+            if(origin->parent != nullptr) parents.emplace_back(0, origin->parent);
+        }
+        std::sort(parents.begin(), parents.end(), [](const auto& a, const auto& b) { return a.second < b.second; });
+        parents.erase(std::unique(parents.begin(), parents.end(), [](const auto& a, const auto& b) { return a.second == b.second; }), parents.end());
+        for(auto& [depth, node] : parents) {
+            for(const CubeTree* up{node->parent}; up != nullptr; up = up->parent) depth++;
         }
+        std::sort(parents.begin(), parents.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+        for(const auto& [depth, node] : parents) compactNode(node);
+
+        std::lock_guard<std::shared_mutex> lock(root->mutex());
+        root->shrink();
+    }
 
-        std::queue<std::future<CubeTree*>> futures;
-        std::mutex insertMutex;
+    // First stage of update: settles the movers still inside their node and takes out the ones
+    // that left it. Movers departs picks are taken out of the tree altogether into departed
+    template<typename D = NoDeparture>
+    static void collectStage(ThreadPool& pool, const std::uint16_t& threads, CubeTree* root, std::vector<Escaped>& escaped, const D& departs = {}, std::vector<Escaped>* departed = nullptr) {
+        std::vector<Escaped> unused;
+        std::vector<Escaped>& gone{(departed != nullptr) ? *departed : unused};
+        std::mutex collectMutex;
+        if constexpr (Options::queryCache) root->context->log.moves.clear();
 
-        for(auto& data : toReinsert) {
-            futures.push(std::async(std::launch::async, [&root, data, &insertMutex]() {
-                std::lock_guard<std::mutex> lock(insertMutex);
-                return root->insert(data);
-            }));
+        if constexpr (Options::markedMoves) {
+            std::vector<Handle> marked{root->context->takeMoved()};
+            ThreadPool::TaskGroup tasks(pool, threads);
+            for(std::size_t first{0}; first < marked.size(); first += BatchGrain) {
+                const std::span<Handle> run{std::span<Handle>(marked).subspan(first, std::min(BatchGrain, marked.size() - first))};
+                root->context->tally(&Counters::collectTasks);
+                tasks.run([root, run, &escaped, &collectMutex, &departs, &gone]() { collectMarked(root->context, run, escaped, collectMutex, departs, gone); });
+            }
+            tasks.wait();
+        } else {
+            ThreadPool::TaskGroup tasks(pool, threads);
+            collectAndRemove(root, escaped, collectMutex, tasks, departs, gone);
+            tasks.wait();
         }
 
-        for(auto& data : toReinsert) data->m_prevPosition = data->m_position;
+        root->context->tally(&Counters::reinserted, escaped.size());
+    }
+
+    // Second stage: puts the collected movers back, returns the topmost node afterwards. A mover
+    // the tree cannot take (not finite, off the fixed point grid) goes back to the node it came
+    // from unsettled, and marked again with Options::markedMoves, so the next update retries it;
+    // one the root fails to grow to was settled already and stays in that node as it is. The
+    // first such error is rethrown once every other mover is back in the tree
+    static CubeTree* reinsertStage(ThreadPool& pool, const std::uint16_t& threads, CubeTree* root, std::vector<Escaped>& escaped) {
+        std::exception_ptr failure;
+        const auto putBack{[&failure, root](CubeTree* origin, Handle& data) {
+            if(!failure) failure = std::current_exception();
+            {
+                const auto lock{origin->exclusiveLock()};
+                origin->store(data);
+            }
+            if constexpr (Options::markedMoves) root->context->mark(data);
+        }};
+
+        // Reinsert from the nearest ancestor that still contains the entity rather than from the root
+        std::unordered_map<CubeTree*, std::vector<Handle>> targets;
+        for(auto& [origin, data] : escaped) {
+            CubeTree* node{origin->parent};
+            while(node != nullptr && !node->holds(data)) node = node->parent;
+            if(node != nullptr) {
+                Traits::settle(data);
+                targets[node].push_back(std::move(data));
+                continue;
+            }
+            try {
+                root->checkEntry(data);
+            } catch(...) {
+                putBack(origin, data);
+                continue;
+            }
+            // Left the root, growing the tree has to happen one entry at a time
+            Traits::settle(data);
+            try {
+                root = root->insert(data);
+            } catch(...) {
+                putBack(origin, data);
+            }
+        }
 
-        while (!futures.empty()) {
-            root = futures.front().get();
-            futures.pop();
+        {
+            ThreadPool::TaskGroup tasks(pool, threads);
+            for(auto& [node, batch] : targets) {
+                tasks.run([node{node}, &batch, &tasks]() {
+                    insertPartition(node, std::move(batch), tasks);
+                });
+            }
+            tasks.wait();
         }
 
         // Ensure root is the topmost parent node
         while (root->parent != nullptr) {
             root = root->parent;
         }
-
+        if(failure) std::rethrow_exception(failure);
         return root;
     }
 
-    void forEach(const std::function<bool(std::shared_ptr<T>&)>& func) {
-        applyFunctionToNode(this, func);
-    }
+    // Last stage: folds back the subtrees the movers left behind, returns the topmost node
+    static CubeTree* compactStage(ThreadPool& pool, const std::uint16_t& threads, CubeTree* root, const std::vector<Escaped>& escaped) {
+        if constexpr (Options::markedMoves) {
+            compactAround(root, escaped);
+        } else {
+            root->compact(pool, threads);
+        }
 
-    void forEachAsync(const std::uint16_t& threads, const std::function<bool(std::shared_ptr<T>&)>& func) {
-        std::queue<std::future<void>> futures;
-        std::mutex futuresMutex;
-        std::atomic<std::uint16_t> activeThreads(0);
+        while (root->parent != nullptr) {
+            root = root->parent;
+        }
 
-        std::function<void(CubeTree*)> applyFunctionToNodeAsync{
-            [&](CubeTree* node) {
-                if(node == nullptr) return;
+        if constexpr (Options::queryCache) root->context->log.updates++;
+        return root;
+    }
 
-                // Apply the function to the data in this node
-                for(auto& data : node->data) {
-                    if(!func(data)) return;
-                }
+    static CubeTree* update(const std::uint16_t& threads, CubeTree* root) {
+        return update(ThreadPool::shared(), threads, root);
+    }
 
-                // Collect tasks for children
-                std::vector<std::future<void>> localFutures;
-                for(std::uint8_t i{0}; i < N; i++) {
-                    for(std::uint8_t j{0}; j < N; j++) {
-                        for(std::uint8_t k{0}; k < N; k++) {
-                            if(node->children[i][j][k] != nullptr) {
-                                std::lock_guard<std::mutex> lock(futuresMutex);
-                                if(activeThreads < threads) {
-                                    // Launch a new asynchronous task
-                                    localFutures.emplace_back(std::async(std::launch::async, applyFunctionToNodeAsync, node->children[i][j][k]));
-                                    activeThreads++;
-                                } else {
-                                    // Process synchronously if the thread limit is reached
-                                    applyFunctionToNodeAsync(node->children[i][j][k]);
-                                }
-                            }
-                        }
-                    }
-                }
+    // Same as above but schedules the subtree tasks onto the given pool, at most `threads` at a time
+    // With Options::markedMoves only the marked entities are visited and only the subtrees they
+    // left are compacted, so the cost follows the number of movers rather than the tree size.
+    // Throws when a mover cannot be stored, see reinsertStage; root is still the topmost node then
+    static CubeTree* update(ThreadPool& pool, const std::uint16_t& threads, CubeTree* root) {
+        std::vector<Escaped> escaped;
+        collectStage(pool, threads, root, escaped);
+        root = reinsertStage(pool, threads, root, escaped);
+        return compactStage(pool, threads, root, escaped);
+    }
 
-                // Manage the futures to respect the thread limit
-                {
-                    std::lock_guard<std::mutex> lock(futuresMutex);
-                    for(auto& future : localFutures) {
-                        futures.push(std::move(future));
-                    }
-                }
+    // Same as above, except that movers for which departs(entity) is true leave the tree: they are
+    // settled, removed and appended to departed instead of being put back, in the same pass that
+    // finds the movers. Used by ShardedCubeTree to hand on the entities that crossed into another cell
+    template<typename D> requires std::predicate<const D&, const Handle&>
+    static CubeTree* update(ThreadPool& pool, const std::uint16_t& threads, CubeTree* root, const D& departs, std::vector<Handle>& departed) {
+        std::vector<Escaped> escaped, gone;
+        collectStage(pool, threads, root, escaped, departs, &gone);
+        for(const auto& [origin, data] : gone) departed.push_back(data);
+        root = reinsertStage(pool, threads, root, escaped);
+        // The nodes the departed left are compacted as well
+        escaped.insert(escaped.end(), std::make_move_iterator(gone.begin()), std::make_move_iterator(gone.end()));
+        return compactStage(pool, threads, root, escaped);
+    }
 
-                // Check and manage futures
-                while (true) {
-                    std::lock_guard<std::mutex> lock(futuresMutex);
-                    if(futures.empty() || activeThreads < threads) break;
-
-                    const auto& future{futures.front()};
-                    if(future.valid()) {
-                        futuresMutex.unlock(); // Unlock before waiting to avoid holding the lock while waiting
-                        future.wait();
-                        futuresMutex.lock(); // Re-lock after waiting
-                        futures.pop();
-                        activeThreads--;
-                    } else {
-                        futures.pop();
-                    }
-                }
-            }
-        };
+    // update split into its collect, reinsert and compact stages. Every stage runs as a task on the
+    // pool while the caller does other work, and can be waited for, polled, chained with a callback
+    // or awaited from a coroutine. The tree must be left alone while a stage runs; between stages it
+    // may be queried, but movers that left their node are missing from it until reinsert is done.
+    // An exception from a stage still ends it, it is rethrown by the next wait, run or co_await
+    class UpdatePipeline {
+    public:
+        enum class Stage : std::uint8_t { Collect, Reinsert, Compact, Done };
 
-        // Start with the root node
-        applyFunctionToNodeAsync(this);
+        UpdatePipeline(ThreadPool& pool, const std::uint16_t& threads, CubeTree* root) :
+            pool(pool), threads(threads), topmost(root) {}
+
+        ~UpdatePipeline() {
+            settle();
+        }
 
-        // Wait for all remaining futures to complete
-        while (true) {
-            std::lock_guard<std::mutex> lock(futuresMutex);
-            if(futures.empty()) break;
+        UpdatePipeline(const UpdatePipeline&) = delete;
+        UpdatePipeline& operator=(const UpdatePipeline&) = delete;
 
-            const auto& future{futures.front()};
-            if(future.valid()) {
-                futuresMutex.unlock(); // Unlock before waiting to avoid holding the lock while waiting
-                future.wait();
-                futuresMutex.lock(); // Re-lock after waiting
-            }
-            futures.pop();
-            activeThreads--;
+        // The stage start runs next, Done once all three finished
+        Stage next() const {
+            return stage.load(std::memory_order_acquire);
         }
-    }
 
-    // Function to query entities within a range around a specified position
-    void queryRange(const std::shared_ptr<T>& entity, const FType& range, std::vector<std::shared_ptr<T>>& results) {
-        // Use the position of the entity as the center
-        const auto& center{entity->m_position};
-        // Check if the query range intersects with this node's bounding box
-        if(intersects(center, range, box)) {
+        // Function to run the next stage on the pool and return at once. then is called from the
+        // worker that finished the stage, after the pipeline is done with it
+        void start(std::function<void()> then = {}) {
             {
                 std::lock_guard<std::mutex> lock(mtx);
-                // Check the data in this node
-                for(const auto& entity : data) {
-                    if(glm::distance(center, entity->m_position) <= range) {
-                        results.push_back(entity);
-                    }
-                }
+                if(running) throw std::logic_error("Update stage is still running!");
+                if(next() == Stage::Done) throw std::logic_error("Update pipeline is done!");
+                running = true;
             }
+            pool.submit([this, then{std::move(then)}]() {
+                std::exception_ptr error;
+                try {
+                    runStage();
+                } catch(...) {
+                    error = std::current_exception();
+                }
+                {
+                    // Notify under the lock, a waiter may destroy the pipeline right after
+                    std::lock_guard<std::mutex> lock(mtx);
+                    failure = error;
+                    stage.store(static_cast<Stage>(static_cast<std::uint8_t>(stage.load(std::memory_order_relaxed)) + 1), std::memory_order_release);
+                    running = false;
+                    finished.notify_all();
+                }
+                if(then) then();
+            });
+        }
+
+        // Whether no stage is running
+        bool ready() {
+            std::lock_guard<std::mutex> lock(mtx);
+            return !running;
+        }
+
+        // Blocks until the running stage finished, helping with queued pool work meanwhile, and
+        // rethrows what the stage threw
+        void wait() {
+            settle();
+            rethrow();
+        }
+
+        // Function to run the remaining stages and return the topmost node afterwards
+        CubeTree* run() {
+            wait();
+            while(next() != Stage::Done) {
+                start();
+                wait();
+            }
+            return topmost;
+        }
+
+        // Topmost node, final once next() is Done
+        CubeTree* root() const {
+            return topmost;
+        }
+
+        // co_await on the pipeline runs the next stage and resumes the coroutine on the worker that
+        // finished it, yielding the stage that follows
+        bool await_ready() const {
+            return next() == Stage::Done;
+        }
+
+        void await_suspend(std::coroutine_handle<> coroutine) {
+            start([coroutine]() { coroutine.resume(); });
+        }
+
+        Stage await_resume() {
+            rethrow();
+            return next();
+        }
+
+    private:
+        void runStage() {
+            const Stage current{next()};
+            if(current == Stage::Collect) collectStage(pool, threads, topmost, escaped);
+            else if(current == Stage::Reinsert) topmost = reinsertStage(pool, threads, topmost, escaped);
+            else topmost = compactStage(pool, threads, topmost, escaped);
+        }
 
-            // Recursively check the children
+        // Blocks until no stage is running
+        void settle() {
+            std::unique_lock<std::mutex> lock(mtx);
+            while(running) {
+                lock.unlock();
+                const bool helped{pool.runPending()};
+                lock.lock();
+                if(!helped && running) finished.wait(lock, [this]() { return !running; });
+            }
+        }
+
+        // Throws the error of the last stage once
+        void rethrow() {
+            std::exception_ptr error;
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                error.swap(failure);
+            }
+            if(error) std::rethrow_exception(error);
+        }
+
+        ThreadPool& pool;
+        const std::uint16_t threads;
+        CubeTree* topmost;
+        std::vector<Escaped> escaped;
+        std::atomic<Stage> stage{Stage::Collect};
+        bool running{false};
+        std::exception_ptr failure;
+        std::mutex mtx;
+        std::condition_variable finished;
+    };
+
+    // Function to start a staged update of the tree below root, nothing runs before start or run
+    static std::unique_ptr<UpdatePipeline> beginUpdate(ThreadPool& pool, const std::uint16_t& threads, CubeTree* root) {
+        return std::make_unique<UpdatePipeline>(pool, threads, root);
+    }
+
+    static std::unique_ptr<UpdatePipeline> beginUpdate(const std::uint16_t& threads, CubeTree* root) {
+        return beginUpdate(ThreadPool::shared(), threads, root);
+    }
+
+    // Function to get the moves of the last update and the update and edit counts, only kept with
+    // Options::queryCache. Must not run alongside update
+    const MoveLog& moveLog() const requires Options::queryCache {
+        return context->log;
+    }
+
+    // Subtrees holding at most this many entries are collapsed into a single leaf. It sits well
+    // below the split point so a freshly split leaf is not merged again on the next update
+    static constexpr std::size_t MergeT{MaxT / 2};
+
+    void compact() {
+        compact(ThreadPool::shared(), ThreadPool::shared().size());
+    }
+
+    // Collapses under-populated subtrees and prunes empty leaves, the children of this node are
+    // compacted in parallel on the given pool
+    void compact(ThreadPool& pool, const std::uint16_t& threads) {
+        if(!isParent()) return;
+        std::size_t counts[N][N][NZ]{};
+        {
+            ThreadPool::TaskGroup tasks(pool, threads);
             for(std::uint8_t i{0}; i < N; i++) {
                 for(std::uint8_t j{0}; j < N; j++) {
-                    for(std::uint8_t k{0}; k < N; k++) {
-                        if(children[i][j][k] != nullptr) {
-                            children[i][j][k]->queryRange(entity, range, results);
+                    for(std::uint8_t k{0}; k < NZ; k++) {
+                        CubeTree* child{children.get(i, j, k)};
+                        if(child != nullptr) {
+                            std::size_t& count{counts[i][j][k]};
+                            tasks.run([child, &count]() { count = compactNode(child); });
+                        }
+                    }
+                }
+            }
+            tasks.wait();
+        }
+        settle(counts);
+
+        if(parent == nullptr) {
+            std::lock_guard<std::shared_mutex> lock(mutex());
+            shrink();
+        }
+    }
+
+    void forEach(const std::function<bool(Handle&)>& func) {
+        applyFunctionToNode(this, func);
+    }
+
+    // Same as above without the std::function indirection, func may also return void to visit everything
+    template<typename F> requires std::invocable<F&, Handle&>
+    void forEach(F&& func) {
+        applyFunctionToNode(this, func);
+    }
+
+    void forEachAsync(const std::uint16_t& threads, const std::function<bool(Handle&)>& func) {
+        forEachAsync(ThreadPool::shared(), threads, func);
+    }
+
+    // Same as above but schedules the subtree tasks onto the given pool, at most `threads` at a time
+    void forEachAsync(ThreadPool& pool, const std::uint16_t& threads, const std::function<bool(Handle&)>& func) {
+        ThreadPool::TaskGroup tasks(pool, threads);
+
+        std::function<void(CubeTree*)> applyFunctionToNodeAsync{
+            [&](CubeTree* node) {
+                // Apply the function to the data in this node
+                for(auto& data : node->data) {
+                    if(!func(data)) return;
+                }
+
+                // Hand the children to the pool, the group runs them inline once the limit is reached
+                for(std::uint8_t i{0}; i < N; i++) {
+                    for(std::uint8_t j{0}; j < N; j++) {
+                        for(std::uint8_t k{0}; k < NZ; k++) {
+                            CubeTree* child{node->children.get(i, j, k)};
+                            if(child != nullptr) {
+                                tasks.run([&applyFunctionToNodeAsync, child]() { applyFunctionToNodeAsync(child); });
+                            }
                         }
                     }
                 }
             }
+        };
+
+        // Start with the root node
+        applyFunctionToNodeAsync(this);
+
+        // Wait for all remaining tasks to complete
+        tasks.wait();
+    }
+
+    // Function to call callback(a, b) once for every unordered pair of entities at most distance
+    // apart, the broad phase of collision detection. Entities of one node are tested against each
+    // other and against the nodes whose boxes come within distance. Takes no locks, the tree must
+    // not be modified meanwhile
+    template<typename F> requires std::invocable<F&, const Handle&, const Handle&>
+    void forEachPairWithin(const FType& distance, F&& callback) {
+        pairsWithin(this, distance * distance, callback, nullptr, 0);
+    }
+
+    // Same as above with the pairs inside and between the subtrees of the upper levels handed to the
+    // pool, at most `threads` at a time. callback is called from several threads at once
+    template<typename F> requires std::invocable<F&, const Handle&, const Handle&>
+    void forEachPairWithin(ThreadPool& pool, const std::uint16_t& threads, const FType& distance, F&& callback) {
+        ThreadPool::TaskGroup tasks(pool, threads);
+        pairsWithin(this, distance * distance, callback, &tasks, 0);
+        tasks.wait();
+    }
+
+    // Function to query entities within a range around a specified position
+    void queryRange(const Handle& entity, const FType& range, std::vector<Handle>& results) {
+        // Use the position of the entity as the center
+        queryRange(Traits::position(entity), range, results);
+    }
+
+    void queryRange(const glm::vec<3, FType, glm::defaultp>& center, const FType& range, std::vector<Handle>& results) {
+        queryRange(center, range, [&results](const Handle& entity) { results.push_back(entity); });
+    }
+
+    // Writes a reference (Traits::Ref, a raw pointer by default) for every entity within range to out
+    // and returns the advanced iterator
+    template<typename OutputIt> requires std::output_iterator<OutputIt, typename Traits::Ref>
+    OutputIt queryRange(const glm::vec<3, FType, glm::defaultp>& center, const FType& range, OutputIt out) {
+        queryRange(center, range, [&out](const Handle& entity) { *out++ = Traits::ref(entity); });
+        return out;
+    }
+
+    // Fills out with references to the entities within range and returns how many matched. When
+    // that is more than out.size() the extra matches are counted but not written
+    std::size_t queryRange(const glm::vec<3, FType, glm::defaultp>& center, const FType& range, std::span<typename Traits::Ref> out) {
+        std::size_t found{0};
+        queryRange(center, range, [&out, &found](const Handle& entity) {
+            if(found < out.size()) out[found] = Traits::ref(entity);
+            found++;
+        });
+        return found;
+    }
+
+    // Calls visitor with every entity within range of center. The entity is passed by reference so
+    // no reference count or heap allocation is touched. visitor runs under the node's shared lock
+    // and must not modify the tree
+    template<typename F> requires std::invocable<F&, const Handle&>
+    void queryRange(const glm::vec<3, FType, glm::defaultp>& center, const FType& range, F&& visitor) {
+        QueryTally tally;
+        if(intersects(center, range, bounds(lockedBox()))) queryRangeNode(center, range, visitor, tally);
+        context->tally(tally);
+    }
+
+    // One request of queryRangeBatch
+    typedef struct RangeQuery {
+        glm::vec<3, FType, glm::defaultp> center;
+        FType range;
+    } RangeQuery;
+
+    // Function to answer many range queries in one descent: the queries are put in Z order, every
+    // node is visited once with the subset of queries overlapping it and its entities are tested
+    // against that subset together. sink(index, entity) is called for every entity within range of
+    // queries[index], under the node's shared lock
+    template<typename F> requires std::invocable<F&, const std::size_t&, const Handle&>
+    void queryRangeBatch(std::span<const RangeQuery> queries, F&& sink) {
+        std::vector<std::uint32_t> active{sortQueries(queries)};
+        QueryTally tally;
+        queryBatchNode(queries, active, 0, sink, tally, nullptr);
+        context->tally(tally, queries.size());
+    }
+
+    void queryRangeBatch(std::span<const RangeQuery> queries, std::vector<std::vector<Handle>>& results) {
+        results.resize(queries.size());
+        queryRangeBatch(queries, [&results](const std::size_t& index, const Handle& entity) { results[index].push_back(entity); });
+    }
+
+    // Same as above with subtrees that many queries reach handed to the pool, at most `threads` at a
+    // time. sink is called from several threads at once and has to be safe for that
+    template<typename F> requires std::invocable<F&, const std::size_t&, const Handle&>
+    void queryRangeBatch(ThreadPool& pool, const std::uint16_t& threads, std::span<const RangeQuery> queries, F&& sink) {
+        std::vector<std::uint32_t> active{sortQueries(queries)};
+        QueryTally tally;
+        {
+            ThreadPool::TaskGroup tasks(pool, threads);
+            queryBatchNode(queries, active, 0, sink, tally, &tasks);
+            tasks.wait();
+        }
+        context->tally(tally, queries.size());
+    }
+
+    // Function to find the count entities closest to pos, appended to results nearest first. Nodes are
+    // visited in order of their distance to pos and the search stops once no unvisited box can
+    // beat the farthest candidate kept
+    void queryKNearest(const glm::vec<3, FType, glm::defaultp>& pos, const std::size_t& count, std::vector<Handle>& results) {
+        if(count == 0) return;
+        typedef std::pair<FType, CubeTree*> Frontier;
+        typedef std::pair<FType, Handle> Candidate;
+        const auto farther{[](const Frontier& a, const Frontier& b) { return a.first > b.first; }};
+        const auto nearer{[](const Candidate& a, const Candidate& b) { return a.first < b.first; }};
+        std::priority_queue<Frontier, std::vector<Frontier>, decltype(farther)> frontier(farther);
+        std::priority_queue<Candidate, std::vector<Candidate>, decltype(nearer)> best(nearer);
+
+        QueryTally tally;
+        frontier.emplace(distance2(bounds(lockedBox()), pos), this);
+        while(!frontier.empty()) {
+            const auto [nodeDistance, node]{frontier.top()};
+            frontier.pop();
+            if(best.size() == count && nodeDistance > best.top().first) break;
+
+            const auto lock{node->sharedLock()};
+            tally.nodes++;
+            tally.entities += node->data.size();
+            for(const auto& entity : node->data) {
+                const glm::vec<3, FType, glm::defaultp> delta{Traits::position(entity) - pos};
+                const FType d2{glm::dot(delta, delta)};
+                if(best.size() < count) {
+                    best.emplace(d2, entity);
+                } else if(d2 < best.top().first) {
+                    best.pop();
+                    best.emplace(d2, entity);
+                }
+            }
+
+            for(std::uint8_t i{0}; i < N; i++) {
+                for(std::uint8_t j{0}; j < N; j++) {
+                    for(std::uint8_t k{0}; k < NZ; k++) {
+                        CubeTree* child{node->children.get(i, j, k)};
+                        if(child == nullptr) continue;
+                        const FType d2{distance2(bounds(child->worldBox()), pos)};
+                        if(best.size() < count || d2 <= best.top().first) frontier.emplace(d2, child);
+                    }
+                }
+            }
+        }
+
+        context->tally(tally);
+
+        const std::size_t first{results.size()};
+        results.resize(first + best.size());
+        for(std::size_t i{results.size()}; i-- > first;) {
+            results[i] = best.top().second;
+            best.pop();
+        }
+    }
+
+    // Squared distance from pos to the closest point of box, zero inside it
+    static const FType distance2(const BBox& box, const glm::vec<3, FType, glm::defaultp>& pos) {
+        const FType halfBl{box.length / 2};
+        FType d2{0};
+        for(glm::length_t axis{0}; axis < Axes; axis++) {
+            const FType offset{std::abs(pos[axis] - box.center[axis]) - halfBl};
+            if(offset > 0) d2 += offset * offset;
+        }
+        return d2;
+    }
+
+    // Plane with normal.p + distance = 0, the side the normal points to counts as inside
+    typedef struct Plane {
+        glm::vec<3, FType, glm::defaultp> normal;
+        FType distance;
+    } Plane;
+
+    // Nearest entity reported by queryRay, found is false (and entity value-initialised) when nothing was hit
+    typedef struct RayHit {
+        Handle entity;
+        FType distance;
+        bool found;
+    } RayHit;
+
+    // How a node box relates to a query shape
+    enum class Overlap : std::uint8_t { Outside, Partial, Inside };
+
+    // Function to visit every entity inside the axis-aligned box [min, max]
+    template<typename F> requires std::invocable<F&, const Handle&>
+    void queryBox(const glm::vec<3, FType, glm::defaultp>& min, const glm::vec<3, FType, glm::defaultp>& max, F&& visitor) {
+        queryShape([&min, &max](const BBox& node) {
+            const FType halfBl{node.length / 2};
+            // A 2D node spans every z, so it is only contained in a box that does as well
+            bool contained{Axes == 3 || (min.z <= std::numeric_limits<FType>::lowest() && max.z >= std::numeric_limits<FType>::max())};
+            for(glm::length_t axis{0}; axis < Axes; axis++) {
+                const FType lo{node.center[axis] - halfBl}, hi{node.center[axis] + halfBl};
+                if(hi < min[axis] || lo > max[axis]) return Overlap::Outside;
+                contained = contained && lo >= min[axis] && hi <= max[axis];
+            }
+            return contained ? Overlap::Inside : Overlap::Partial;
+        }, [&min, &max](const glm::vec<3, FType, glm::defaultp>& pos) {
+            return pos.x >= min.x && pos.x <= max.x && pos.y >= min.y && pos.y <= max.y && pos.z >= min.z && pos.z <= max.z;
+        }, visitor);
+    }
+
+    void queryBox(const glm::vec<3, FType, glm::defaultp>& min, const glm::vec<3, FType, glm::defaultp>& max, std::vector<Handle>& results) {
+        queryBox(min, max, [&results](const Handle& entity) { results.push_back(entity); });
+    }
+
+    // Function to visit every entity on the inside of all planes, e.g. the six planes of a view frustum.
+    // Node boxes are rejected on the corner farthest along each plane normal
+    template<typename F> requires std::invocable<F&, const Handle&>
+    void queryFrustum(std::span<const Plane> planes, F&& visitor) {
+        queryShape([planes](const BBox& node) {
+            const FType halfBl{node.length / 2};
+            bool contained{true};
+            for(const Plane& plane : planes) {
+                // A 2D node spans every z, any plane tilted out of the xy plane cuts through it
+                if(Axes == 2 && plane.normal.z != 0) {
+                    contained = false;
+                    continue;
+                }
+                const FType centerDistance{glm::dot(plane.normal, node.center) + plane.distance};
+                const FType reach{halfBl * (std::abs(plane.normal.x) + std::abs(plane.normal.y) + ((Axes == 3) ? std::abs(plane.normal.z) : FType{0}))};
+                if(centerDistance + reach < 0) return Overlap::Outside;
+                contained = contained && centerDistance - reach >= 0;
+            }
+            return contained ? Overlap::Inside : Overlap::Partial;
+        }, [planes](const glm::vec<3, FType, glm::defaultp>& pos) {
+            for(const Plane& plane : planes)
+                if(glm::dot(plane.normal, pos) + plane.distance < 0) return false;
+            return true;
+        }, visitor);
+    }
+
+    void queryFrustum(std::span<const Plane> planes, std::vector<Handle>& results) {
+        queryFrustum(planes, [&results](const Handle& entity) { results.push_back(entity); });
+    }
+
+    // Function to cast a ray (a segment when maxDistance is finite) and return the nearest hit.
+    // hitDistance(entity) returns the distance along the normalised direction at which the ray
+    // hits the entity, or infinity for a miss (negative and non-finite distances never count as hits). Nodes are walked front to back by their entry
+    // distance, inflated by padding for entities with extents, and the walk stops at the first
+    // node that starts behind the nearest hit found so far
+    template<typename F> requires std::invocable<F&, const Handle&>
+    RayHit queryRay(const glm::vec<3, FType, glm::defaultp>& origin, const glm::vec<3, FType, glm::defaultp>& direction, const FType& maxDistance, const FType& padding, F&& hitDistance) {
+        RayHit hit{Handle{}, maxDistance, false};
+        const FType dirLength{glm::length(direction)};
+        if(!(dirLength > 0)) return hit;
+        const glm::vec<3, FType, glm::defaultp> dir{direction / dirLength};
+
+        typedef std::pair<FType, CubeTree*> Frontier;
+        const auto farther{[](const Frontier& a, const Frontier& b) { return a.first > b.first; }};
+        std::priority_queue<Frontier, std::vector<Frontier>, decltype(farther)> frontier(farther);
+
+        QueryTally tally;
+        FType entry;
+        if(slab(bounds(lockedBox()), padding, origin, dir, hit.distance, entry)) frontier.emplace(entry, this);
+        while(!frontier.empty()) {
+            const auto [nodeEntry, node]{frontier.top()};
+            frontier.pop();
+            if(nodeEntry > hit.distance) break;
+
+            const auto lock{node->sharedLock()};
+            tally.nodes++;
+            tally.entities += node->data.size();
+            for(const auto& entity : node->data) {
+                const FType distance{static_cast<FType>(hitDistance(entity))};
+                if(std::isfinite(distance) && distance >= 0 && distance <= hit.distance) {
+                    hit.entity = entity;
+                    hit.found = true;
+                    hit.distance = distance;
+                }
+            }
+
+            for(std::uint8_t i{0}; i < N; i++) {
+                for(std::uint8_t j{0}; j < N; j++) {
+                    for(std::uint8_t k{0}; k < NZ; k++) {
+                        CubeTree* child{node->children.get(i, j, k)};
+                        if(child != nullptr && slab(bounds(child->worldBox()), padding, origin, dir, hit.distance, entry)) frontier.emplace(entry, child);
+                    }
+                }
+            }
         }
+        context->tally(tally);
+        return hit;
+    }
+
+    // Same as above treating every entity as a sphere of the given radius around its position
+    RayHit queryRay(const glm::vec<3, FType, glm::defaultp>& origin, const glm::vec<3, FType, glm::defaultp>& direction, const FType& maxDistance, const FType& radius) {
+        const FType dirLength{glm::length(direction)};
+        const glm::vec<3, FType, glm::defaultp> dir{(dirLength > 0) ? direction / dirLength : direction};
+        return queryRay(origin, direction, maxDistance, radius, [&](const Handle& entity) {
+            const glm::vec<3, FType, glm::defaultp> toCenter{Traits::position(entity) - origin};
+            const FType along{glm::dot(toCenter, dir)};
+            const FType miss2{glm::dot(toCenter, toCenter) - along * along};
+            const FType radius2{radius * radius};
+            if(miss2 > radius2) return std::numeric_limits<FType>::infinity();
+            const FType entry{along - std::sqrt(radius2 - miss2)};
+            return (entry >= 0) ? entry : ((along + std::sqrt(radius2 - miss2) >= 0) ? FType{0} : std::numeric_limits<FType>::infinity());
+        });
     }
 
 private:
+    // Slab test of a ray with unit direction against box grown by padding. On a hit within
+    // [0, maxDistance] stores the entry distance (zero when the origin is inside)
+    static const bool slab(const BBox& box, const FType& padding, const glm::vec<3, FType, glm::defaultp>& origin, const glm::vec<3, FType, glm::defaultp>& dir, const FType& maxDistance, FType& entry) {
+        const FType halfBl{box.length / 2 + padding};
+        FType near{0}, far{maxDistance};
+        for(glm::length_t axis{0}; axis < Axes; axis++) {
+            const FType lo{box.center[axis] - halfBl - origin[axis]}, hi{box.center[axis] + halfBl - origin[axis]};
+            if(dir[axis] == 0) {
+                if(lo > 0 || hi < 0) return false;
+                continue;
+            }
+            FType t0{lo / dir[axis]}, t1{hi / dir[axis]};
+            if(t0 > t1) std::swap(t0, t1);
+            near = std::max(near, t0);
+            far = std::min(far, t1);
+            if(near > far) return false;
+        }
+        entry = near;
+        return true;
+    }
+
+    // Recursive walk of queryRange, counting the work into tally. The caller has already found the
+    // range to intersect this node; child boxes are tested here under this node's lock
+    template<typename F>
+    void queryRangeNode(const glm::vec<3, FType, glm::defaultp>& center, const FType& range, F& visitor, QueryTally& tally) {
+        CubeTree* next[Slots];
+        std::size_t count{0};
+        {
+            const auto lock{sharedLock()};
+            tally.nodes++;
+            tally.entities += data.size();
+            // Check the data in this node
+            if constexpr (Options::soaLeaves) {
+                const FType point[3]{center.x, center.y, center.z};
+                RangeKernel<FType>::within(positions.x.data(), positions.y.data(), positions.z.data(), data.size(), point, range * range, [&](const std::size_t& index) {
+                    visitor(data[index]);
+                });
+            } else {
+                for(const auto& entity : data) {
+                    if(glm::distance(center, Traits::position(entity)) <= range) {
+                        visitor(entity);
+                    }
+                }
+            }
+            // Take the children overlapping the range while locked, a concurrent split may be adding to them
+            for(std::uint8_t i{0}; i < N; i++)
+                for(std::uint8_t j{0}; j < N; j++)
+                    for(std::uint8_t k{0}; k < NZ; k++) {
+                        CubeTree* child{children.get(i, j, k)};
+                        if(child != nullptr && intersects(center, range, bounds(child->worldBox()))) next[count++] = child;
+                    }
+        }
+
+        // Recursively check the children
+        for(std::size_t index{0}; index < count; index++) {
+            next[index]->queryRangeNode(center, range, visitor, tally);
+        }
+    }
+
+    // Indices of queries ordered along a Z curve through the box of this node, so that queries
+    // close to each other are tested one after another
+    std::vector<std::uint32_t> sortQueries(std::span<const RangeQuery> queries) {
+        if(queries.size() > UINT32_MAX) throw std::invalid_argument("Too many queries for one batch!");
+        const BBox frame{lockedBox()};
+        const FType halfBl{frame.length / 2};
+        std::vector<std::pair<std::uint32_t, std::uint32_t>> keyed(queries.size());
+        for(std::size_t index{0}; index < queries.size(); index++) {
+            std::uint32_t key{0};
+            for(glm::length_t axis{0}; axis < 3; axis++) {
+                const FType scaled{(queries[index].center[axis] - (frame.center[axis] - halfBl)) / frame.length * 1024};
+                const std::uint32_t cell{(scaled > 0) ? std::min(static_cast<std::uint32_t>(scaled), 1023u) : 0u};
+                for(std::uint32_t bit{0}; bit < 10; bit++) key |= ((cell >> bit) & 1u) << (bit * 3 + axis);
+            }
+            keyed[index] = {key, static_cast<std::uint32_t>(index)};
+        }
+        std::sort(keyed.begin(), keyed.end());
+        std::vector<std::uint32_t> order(queries.size());
+        for(std::size_t index{0}; index < keyed.size(); index++) order[index] = keyed[index].second;
+        return order;
+    }
+
+    // Recursive walk of queryRangeBatch. The queries passed down from the parent are active[first..],
+    // the ones overlapping this node are appended behind them for the children and dropped again
+    // on return. With tasks, children reached by at least BatchGrain queries get a task and their own list
+    template<typename F>
+    void queryBatchNode(std::span<const RangeQuery> queries, std::vector<std::uint32_t>& active, const std::size_t& first, F& sink, QueryTally& tally, ThreadPool::TaskGroup* tasks) {
+        const std::size_t begin{active.size()};
+        std::size_t end;
+        CubeTree* next[Slots];
+        std::size_t count;
+        {
+            // The box is only read under the lock, insert may be growing the root in place
+            const auto lock{sharedLock()};
+            const BBox reach{bounds(worldBox())};
+            for(std::size_t index{first}; index < begin; index++) {
+                const std::uint32_t query{active[index]};
+                if(intersects(queries[query].center, queries[query].range, reach)) active.push_back(query);
+            }
+            end = active.size();
+            if(begin == end) return;
+
+            tally.nodes++;
+            tally.entities += data.size() * (end - begin);
+            for(const auto& entity : data) {
+                const auto& pos{Traits::position(entity)};
+                for(std::size_t index{begin}; index < end; index++) {
+                    const RangeQuery& query{queries[active[index]]};
+                    if(glm::distance(query.center, pos) <= query.range) sink(static_cast<std::size_t>(active[index]), entity);
+                }
+            }
+            count = listChildren(next);
+        }
+
+        for(std::size_t index{0}; index < count; index++) {
+            CubeTree* child{next[index]};
+            if(tasks != nullptr && end - begin >= BatchGrain) {
+                tasks->run([child, queries, own{std::vector<std::uint32_t>(active.begin() + begin, active.begin() + end)}, &sink, tasks]() mutable {
+                    QueryTally childTally;
+                    child->queryBatchNode(queries, own, 0, sink, childTally, tasks);
+                    child->context->tally(childTally, 0);
+                });
+            } else {
+                child->queryBatchNode(queries, active, begin, sink, tally, tasks);
+            }
+        }
+        active.resize(begin);
+    }
+
+    // Shared walk of the shape queries. classify(box) places a node box against the shape and
+    // accept(pos) tests a single entity; entities of subtrees fully inside are not tested again
+    template<typename Classify, typename Accept, typename F>
+    void queryShape(const Classify& classify, const Accept& accept, F& visitor) {
+        QueryTally tally;
+        queryShapeNode(classify, accept, visitor, false, tally);
+        context->tally(tally);
+    }
+
+    template<typename Classify, typename Accept, typename F>
+    void queryShapeNode(const Classify& classify, const Accept& accept, F& visitor, const bool& contained, QueryTally& tally) {
+        Overlap overlap{Overlap::Inside};
+        CubeTree* next[Slots];
+        std::size_t count;
+        {
+            // The box is only read under the lock, insert may be growing the root in place
+            const auto lock{sharedLock()};
+            if(!contained) overlap = classify(bounds(worldBox()));
+            if(overlap == Overlap::Outside) return;
+            tally.nodes++;
+            if(overlap != Overlap::Inside) tally.entities += data.size();
+            for(const auto& entity : data) {
+                if(overlap == Overlap::Inside || accept(Traits::position(entity))) visitor(entity);
+            }
+            count = listChildren(next);
+        }
+
+        for(std::size_t index{0}; index < count; index++) {
+            next[index]->queryShapeNode(classify, accept, visitor, overlap == Overlap::Inside, tally);
+        }
+    }
+
     const bool intersects(const glm::vec<3, FType, glm::defaultp>& center, FType range, const BBox& box) const {
         const glm::vec<3, FType, glm::defaultp> boxMin{box.center - glm::vec<3, FType, glm::defaultp>(box.length / 2)};
         const glm::vec<3, FType, glm::defaultp> boxMax{box.center + glm::vec<3, FType, glm::defaultp>(box.length / 2)};
@@ -337,109 +1692,614 @@ private:
 
         return (rangeMin.x <= boxMax.x && rangeMax.x >= boxMin.x) &&
                (rangeMin.y <= boxMax.y && rangeMax.y >= boxMin.y) &&
-               (rangeMin.z <= boxMax.z && rangeMax.z >= boxMin.z);
+               (Axes == 2 || (rangeMin.z <= boxMax.z && rangeMax.z >= boxMin.z));
+    }
+
+    // Levels below the root at which forEachPairWithin still creates tasks
+    static constexpr std::uint32_t PairTaskDepth{2};
+
+    // Whether some point of box a is within the distance whose square is range2 of some point of box b
+    static const bool near(const BBox& a, const BBox& b, const FType& range2) {
+        const FType reach{(a.length + b.length) / 2};
+        FType d2{0};
+        for(glm::length_t axis{0}; axis < Axes; axis++) {
+            const FType gap{std::abs(a.center[axis] - b.center[axis]) - reach};
+            if(gap > 0) d2 += gap * gap;
+        }
+        return d2 <= range2;
     }
 
-    static void applyFunctionToNode(CubeTree* node, const std::function<bool(std::shared_ptr<T>&)>& func) {
+    template<typename F>
+    static void testPair(const Handle& a, const Handle& b, const FType& range2, F& callback) {
+        const glm::vec<3, FType, glm::defaultp> delta{Traits::position(a) - Traits::position(b)};
+        if(glm::dot(delta, delta) <= range2) callback(a, b);
+    }
+
+    // Every pair within the subtree of node: inside its own entries, its entries against its
+    // children, inside every child and between every two children
+    template<typename F>
+    static void pairsWithin(CubeTree* node, const FType& range2, F& callback, ThreadPool::TaskGroup* tasks, const std::uint32_t& depth) {
+        for(std::size_t a{0}; a < node->data.size(); a++)
+            for(std::size_t b{a + 1}; b < node->data.size(); b++) testPair(node->data[a], node->data[b], range2, callback);
+
+        CubeTree* next[Slots];
+        const std::size_t count{node->listChildren(next)};
+        if(!node->data.empty()) {
+            std::vector<const Handle*> entries;
+            for(const auto& entity : node->data) entries.push_back(&entity);
+            for(std::size_t index{0}; index < count; index++) pairsAgainst(entries, next[index], range2, callback);
+        }
+
+        const bool spawn{tasks != nullptr && depth < PairTaskDepth};
+        for(std::size_t a{0}; a < count; a++) {
+            CubeTree* first{next[a]};
+            if(spawn) tasks->run([first, range2, &callback, tasks, depth]() { pairsWithin(first, range2, callback, tasks, depth + 1); });
+            else pairsWithin(first, range2, callback, tasks, depth + 1);
+            for(std::size_t b{a + 1}; b < count; b++) {
+                CubeTree* second{next[b]};
+                if(spawn) tasks->run([first, second, range2, &callback]() { pairsBetween(first, second, range2, callback); });
+                else pairsBetween(first, second, range2, callback);
+            }
+        }
+    }
+
+    // Every pair with one entity below a and the other below b, two disjoint subtrees. The larger
+    // node is opened so both sides shrink at about the same rate
+    template<typename F>
+    static void pairsBetween(CubeTree* a, CubeTree* b, const FType& range2, F& callback) {
+        if(!near(bounds(a->worldBox()), bounds(b->worldBox()), range2)) return;
+        if(a->worldBox().length < b->worldBox().length) std::swap(a, b);
+        if(!a->data.empty()) {
+            std::vector<const Handle*> entries;
+            for(const auto& entity : a->data) entries.push_back(&entity);
+            pairsAgainst(entries, b, range2, callback);
+        }
+        CubeTree* next[Slots];
+        const std::size_t count{a->listChildren(next)};
+        for(std::size_t index{0}; index < count; index++) pairsBetween(next[index], b, range2, callback);
+    }
+
+    // Every pair of one of entries with an entity of the subtree of node, only the entries that
+    // come within distance of a box are carried into it
+    template<typename F>
+    static void pairsAgainst(const std::vector<const Handle*>& entries, CubeTree* node, const FType& range2, F& callback) {
+        const BBox reach{bounds(node->worldBox())};
+        std::vector<const Handle*> close;
+        for(const Handle* entity : entries) {
+            if(distance2(reach, Traits::position(*entity)) <= range2) close.push_back(entity);
+        }
+        if(close.empty()) return;
+        for(const Handle* entity : close)
+            for(const auto& other : node->data) testPair(*entity, other, range2, callback);
+        CubeTree* next[Slots];
+        const std::size_t count{node->listChildren(next)};
+        for(std::size_t index{0}; index < count; index++) pairsAgainst(close, next[index], range2, callback);
+    }
+
+    template<typename F>
+    static void applyFunctionToNode(CubeTree* node, F& func) {
         // std::lock_guard<std::mutex> lock(node->mtx);
 
         // Apply the function to the data in this node
         for(auto& data : node->data) {
-            if(!func(data)) return;
+            if constexpr (std::is_void_v<std::invoke_result_t<F&, Handle&>>) {
+                func(data);
+            } else {
+                if(!func(data)) return;
+            }
         }
 
         // Recursively apply the function to all children
         for(std::uint8_t i{0}; i < N; i++) {
             for(std::uint8_t j{0}; j < N; j++) {
-                for(std::uint8_t k{0}; k < N; k++) {
-                    if(node->children[i][j][k] != nullptr) {
-                        applyFunctionToNode(node->children[i][j][k], func);
+                for(std::uint8_t k{0}; k < NZ; k++) {
+                    if(node->children.get(i, j, k) != nullptr) {
+                        applyFunctionToNode(node->children.get(i, j, k), func);
                     }
                 }
             }
         }
     }
 
-    bool remove(std::shared_ptr<T> data) {
-        std::lock_guard<std::mutex> lock(mtx);
-        if(inside(this->box, data->m_position)) {
-            auto it{std::find(this->data.begin(), this->data.end(), data)};
-            if(it != this->data.end()) {
-                this->data.erase(it);
-                return true;
+    // Constructor for a child node, the slot computation already placed data inside box
+    CubeTree(CubeTree* parent, const NodeBox& box, Handle data) :
+        parent(parent), children{}, box(box), childCount(0), context(parent->context) {
+        store(data);
+    }
+
+    // Constructor for an empty inner node
+    CubeTree(CubeTree* parent, const NodeBox& box) :
+        parent(parent), children{}, box(box), childCount(0), context(parent->context) {}
+
+    // Constructor for an empty root, only used by build
+    explicit CubeTree(const BBox& box) :
+        parent(nullptr), children{}, box(rootBox(box)), childCount(0), context(new Context()) {
+        adoptGrid(box);
+    }
+
+    friend NodeAllocator<CubeTree>;
+
+    // Appends an entry to this leaf, the caller holds the node lock
+    void store(const Handle& entity) {
+        context->locate(entity, this);
+        positions.push(Traits::position(entity));
+        data.push_back(entity);
+    }
+
+    // Swap-removes the entry at index from this leaf, the caller holds the node lock
+    void eraseAt(const std::size_t& index) {
+        data[index] = std::move(data.back());
+        data.pop_back();
+        positions.erase(index);
+    }
+
+    // Drops every entry of this leaf and its storage, the caller holds the node lock
+    void clearData() {
+        data.clear();
+        data.shrink_to_fit();
+        positions.clear();
+    }
+
+    // Copies the present children into out and returns how many there are, the caller holds the node lock
+    std::size_t listChildren(CubeTree* (&out)[Slots]) const {
+        std::size_t count{0};
+        for(std::uint8_t i{0}; i < N; i++)
+            for(std::uint8_t j{0}; j < N; j++)
+                for(std::uint8_t k{0}; k < NZ; k++)
+                    if(children.get(i, j, k) != nullptr) out[count++] = children.get(i, j, k);
+        return count;
+    }
+
+    void pushChildren(std::vector<CubeTree*>& pending) const {
+        for(std::uint8_t i{0}; i < N; i++)
+            for(std::uint8_t j{0}; j < N; j++)
+                for(std::uint8_t k{0}; k < NZ; k++)
+                    if(children.get(i, j, k) != nullptr) pending.push_back(children.get(i, j, k));
+    }
+
+    // Throws when data cannot be stored in the tree at all, whatever its box
+    void checkEntry(const Handle& data) const {
+        const auto& pos{Traits::position(data)};
+        if(!std::isfinite(pos.x) || !std::isfinite(pos.y) || !std::isfinite(pos.z)) throw std::invalid_argument("Entry position is not finite!");
+        if constexpr (Options::loose) {
+            if(!std::isfinite(Traits::radius(data)) || Traits::radius(data) < 0) throw std::invalid_argument("Entry radius is negative or not finite!");
+        }
+        if constexpr (Options::fixedPoint) {
+            std::int64_t q[3];
+            if(!quantize(pos, q)) throw std::invalid_argument("Entry position is outside the fixed point grid!");
+        }
+    }
+
+    // Grows the topmost node in place towards pos: its contents move into a new child and its box
+    // becomes N times as long, placed so the old box is exactly one of its child slots. The root
+    // keeps its identity and never needs the allocator. The caller holds mtx
+    void grow(const glm::vec<3, FType, glm::defaultp>& pos) {
+        // Along each axis leave the free slots on the side of pos, z stays in slot 0 in 2D
+        std::uint8_t slot[3]{};
+        NodeBox grown;
+        if constexpr (Options::fixedPoint) {
+            if(box.level >= MaxLevel) throw std::invalid_argument("Entry position is outside the fixed point grid!");
+            std::int64_t q[3];
+            quantize(pos, q);
+            const std::int64_t size{cellsAt(box.level)};
+            const std::int64_t corner[3]{box.x, box.y, box.z};
+            std::int32_t grownCorner[3]{};
+            for(glm::length_t axis{0}; axis < Axes; axis++) {
+                if(q[axis] < corner[axis]) slot[axis] = N - 1;
+                else if(q[axis] >= corner[axis] + size) slot[axis] = 0;
+                else slot[axis] = (q[axis] - corner[axis] < size / 2) ? N / 2 : (N - 1) / 2;
+                const std::int64_t lo{corner[axis] - size * slot[axis]};
+                if(lo < INT32_MIN || lo + size * N > std::int64_t{INT32_MAX} + 1) throw std::invalid_argument("Entry position is outside the fixed point grid!");
+                grownCorner[axis] = static_cast<std::int32_t>(lo);
             }
+            grown = {grownCorner[0], grownCorner[1], grownCorner[2], static_cast<std::uint8_t>(box.level + 1)};
+        }
+        else {
+            const FType halfBl{box.length / 2};
+            glm::vec<3, FType, glm::defaultp> center{box.center};
+            for(glm::length_t axis{0}; axis < Axes; axis++) {
+                const FType lo{box.center[axis] - halfBl};
+                if(pos[axis] < lo) slot[axis] = N - 1;
+                else if(pos[axis] > box.center[axis] + halfBl) slot[axis] = 0;
+                else slot[axis] = (pos[axis] < box.center[axis]) ? N / 2 : (N - 1) / 2;
+                center[axis] = lo - box.length * slot[axis] + box.length * N / 2;
+            }
+            // Nothing else bounds the growth in floating point, stop before the box overflows
+            if(!std::isfinite(box.length * N) || !std::isfinite(center.x) || !std::isfinite(center.y) || !std::isfinite(center.z)) throw std::invalid_argument("Entry position is too far out to grow the tree to!");
+            grown = {center, box.length * N};
+        }
 
-            for(std::uint8_t i{0}; i < N; i++) {
-                for(std::uint8_t j{0}; j < N; j++) {
-                    for(std::uint8_t k{0}; k < N; k++) {
-                        if(children[i][j][k] != nullptr) {
-                            if(children[i][j][k]->remove(data)) {
-                                return true;
-                            }
-                        }
-                    }
+        CubeTree* moved{context->nodes.create(this, box)};
+        adopt(moved, *this);
+        box = grown;
+        children.set(slot[0], slot[1], slot[2], moved);
+        childCount = 1;
+        context->grown++;
+        context->tally(&Counters::growths);
+    }
+
+    // Undoes grow while the root only holds the single child growth created, the caller holds the node lock
+    void shrink() {
+        while(context->grown != 0 && childCount == 1 && data.empty()) {
+            std::vector<CubeTree*> only;
+            pushChildren(only);
+            CubeTree* child{only.front()};
+            children = {};
+            box = child->box;
+            adopt(this, *child);
+            context->nodes.destroy(child);
+            context->grown--;
+        }
+    }
+
+    // Moves the children and entries of from into the empty node to
+    static void adopt(CubeTree* to, CubeTree& from) {
+        to->children = std::move(from.children);
+        from.children = {};
+        std::vector<CubeTree*> moved;
+        to->pushChildren(moved);
+        for(CubeTree* child : moved) child->parent = to;
+        to->childCount = from.childCount;
+        from.childCount = 0;
+        to->data = std::move(from.data);
+        to->positions = std::move(from.positions);
+        from.clearData();
+        for(const auto& d : to->data) to->context->locate(d, to);
+    }
+
+    // Whether the children of this node would still be distinguishable in FType
+    const bool canSplit() const {
+        if constexpr (Options::fixedPoint) {
+            return box.level > 0;
+        }
+        else {
+            const FType extent{std::max({std::abs(box.center.x), std::abs(box.center.y), (Axes == 3) ? std::abs(box.center.z) : FType{0}, box.length})};
+            return (box.length / N) > extent * std::numeric_limits<FType>::epsilon() * N;
+        }
+    }
+
+    // In loose mode whether data is small enough for child slot [i][j][k], always true otherwise
+    const bool fitsChild(const Handle& data, const std::uint8_t& i, const std::uint8_t& j, const std::uint8_t& k) const {
+        if constexpr (Options::loose) return fits(childBox(i, j, k), data);
+        else return true;
+    }
+
+    // Function to insert data into the child node covering its position, the caller holds the node lock.
+    // Returns false without inserting when data is too large for that child in loose mode
+    const bool insertToChild(Handle data) {
+        const auto [i, j, k]{slotOf(Traits::position(data))};
+        if(!fitsChild(data, i, j, k)) return false;
+        CubeTree* child{children.get(i, j, k)};
+        if(child == nullptr) {
+            children.set(i, j, k, context->nodes.create(this, childBox(i, j, k), data));
+            childCount++;
+        } else {
+            child->store(data);
+        }
+        return true;
+    }
+
+    // Moves the data of an over-full leaf into its children, the caller holds the node lock. In loose mode
+    // entries too large for any child stay behind
+    void split() {
+        context->tally(&Counters::splits);
+        std::vector<Handle> kept;
+        for(auto& d : data)
+            if(!insertToChild(d)) kept.push_back(d);
+        clearData();
+        for(const auto& d : kept) store(d);
+
+        // A child that received everything is split again, it is not reachable by other threads yet
+        for(std::uint8_t i{0}; i < N; i++) {
+            for(std::uint8_t j{0}; j < N; j++) {
+                for(std::uint8_t k{0}; k < NZ; k++) {
+                    CubeTree* child{children.get(i, j, k)};
+                    if(child != nullptr && child->data.size() > MaxT && child->canSplit()) child->split();
                 }
             }
         }
-        return false;
     }
-    
-    // Function to insert data into a child node
-    void insertToChild(std::shared_ptr<T> data) {
-        for (std::uint8_t i = 0; i < N; ++i) {
-            for (std::uint8_t j = 0; j < N; ++j) {
-                for (std::uint8_t k = 0; k < N; ++k) {
-                    const FType childLength{box.length / N};
-                    const BBox childBBox{
-                        {
-                            box.center.x - (box.length / 2) + childLength * (i + 0.5f),
-                            box.center.y - (box.length / 2) + childLength * (j + 0.5f),
-                            box.center.z - (box.length / 2) + childLength * (k + 0.5f)
-                        },
-                        childLength
-                    };
-                    if (inside(childBBox, data->m_position)) {
-                        auto& child{children[i][j][k]};
-                        if (child == nullptr) {
-                            child = new CubeTree(childBBox, data);
-                            child->parent = this;
-                        } else {
-                            child->data.push_back(data);
-                        }
-                        return;
-                    }
-                    else {
-                        // std::cout << "Data: " << data->m_name << " position was not inside bounding box of the child node! checking next!\n";
+
+    // Walks down from this node, which contains data, to the leaf covering it (in loose mode to the
+    // deepest node data fits). Locks are taken hand over hand so only the current node is held while descending
+    void insertDescend(Handle data, std::unique_lock<std::shared_mutex> lock) {
+        const auto& pos{Traits::position(data)};
+        CubeTree* node{this};
+        while(node->isParent()) {
+            const auto [i, j, k]{node->slotOf(pos)};
+            if(!node->fitsChild(data, i, j, k)) break;
+            CubeTree* child{node->children.get(i, j, k)};
+            if(child == nullptr) {
+                node->children.set(i, j, k, node->context->nodes.create(node, node->childBox(i, j, k), data));
+                node->childCount++;
+                return;
+            }
+            if constexpr (Options::compactNodes) {
+                // Striped locks may be shared by parent and child or taken in either order by two
+                // threads, so the parent is let go first. Nodes are only released by compact, which
+                // does not run alongside inserts
+                lock.unlock();
+                lock = child->exclusiveLock();
+            } else {
+                std::unique_lock<std::shared_mutex> childLock{child->exclusiveLock()};
+                lock.swap(childLock);
+                childLock.unlock();
+            }
+            node = child;
+        }
+
+        node->store(data);
+        if(!node->isParent() && node->data.size() > MaxT && node->canSplit()) node->split();
+    }
+
+    // Compacts the subtree below node bottom-up, returns the number of entries it holds
+    static std::size_t compactNode(CubeTree* node) {
+        if(!node->isParent()) return node->data.size();
+        std::size_t counts[N][N][NZ]{};
+        for(std::uint8_t i{0}; i < N; i++)
+            for(std::uint8_t j{0}; j < N; j++)
+                for(std::uint8_t k{0}; k < NZ; k++)
+                    if(node->children.get(i, j, k) != nullptr) counts[i][j][k] = compactNode(node->children.get(i, j, k));
+        return node->settle(counts);
+    }
+
+    // Given the entry counts of the compacted children, prunes empty child leaves and collapses the
+    // node if the whole subtree fits within MergeT. Returns the subtree count
+    std::size_t settle(const std::size_t (&counts)[N][N][NZ]) {
+        const auto lock{exclusiveLock()};
+        std::size_t total{data.size()};
+        for(std::uint8_t i{0}; i < N; i++) {
+            for(std::uint8_t j{0}; j < N; j++) {
+                for(std::uint8_t k{0}; k < NZ; k++) {
+                    CubeTree* child{children.get(i, j, k)};
+                    if(child == nullptr) continue;
+                    total += counts[i][j][k];
+                    if(counts[i][j][k] == 0 && !child->isParent()) {
+                        context->nodes.destroy(child);
+                        children.set(i, j, k, nullptr);
+                        childCount--;
                     }
                 }
             }
         }
+        if(isParent() && total <= MergeT) collapse();
+        return total;
     }
 
-public:
-    // Function to insert data into the tree
-    CubeTree* insert(std::shared_ptr<T> data) {
-        std::lock_guard<std::mutex> lock(mtx);
-        if(inside(this->box, data->m_position)) {
-            if(isParent()) {
-                insertToChild(data);
-            }
-            else {
-                if(this->data.size() < MaxT) {
-                    this->data.emplace_back(data);
+    // Pulls every entry below this node into its own data and releases the subtree, the caller holds the node lock
+    void collapse() {
+        std::vector<CubeTree*> pending;
+        pushChildren(pending);
+        while(!pending.empty()) {
+            CubeTree* node{pending.back()};
+            pending.pop_back();
+            node->pushChildren(pending);
+            for(const auto& d : node->data) store(d);
+            context->nodes.destroy(node);
+        }
+        children = {};
+        childCount = 0;
+    }
+
+    // Buckets that are smaller than this are inserted by the task that produced them
+    static constexpr std::size_t BatchGrain{256};
+
+    // Inserts a batch of entries contained in node: the batch is bucketed by child slot under the
+    // node lock, then every bucket continues into its child as a separate task. Loose entries too
+    // large for their child are stored in node itself
+    static void insertPartition(CubeTree* node, std::vector<Handle> batch, ThreadPool::TaskGroup& tasks) {
+        std::vector<std::vector<Handle>> buckets(Slots);
+        std::vector<CubeTree*> targets(Slots);
+        {
+            const auto lock{node->exclusiveLock()};
+            if(!node->isParent()) {
+                if(node->data.size() + batch.size() <= MaxT || !node->canSplit()) {
+                    for(const auto& data : batch) node->store(data);
+                    return;
                 }
-                else {
-                    for(auto& d : this->data)
-                        insertToChild(d);
-                    this->data.clear();
+                batch.insert(batch.end(), node->data.begin(), node->data.end());
+                node->clearData();
+                node->context->tally(&Counters::splits);
+            }
+
+            for(auto& data : batch) {
+                const auto [i, j, k]{node->slotOf(Traits::position(data))};
+                if(node->fitsChild(data, i, j, k)) buckets[(i * N + j) * NZ + k].push_back(std::move(data));
+                else node->store(data);
+            }
+
+            // Create the missing children while the node is still held, seeding each with one entry
+            for(std::size_t slot{0}; slot < buckets.size(); slot++) {
+                auto& bucket{buckets[slot]};
+                if(bucket.empty()) continue;
+                const std::uint8_t i{static_cast<std::uint8_t>(slot / (N * NZ))};
+                const std::uint8_t j{static_cast<std::uint8_t>((slot / NZ) % N)};
+                const std::uint8_t k{static_cast<std::uint8_t>(slot % NZ)};
+                targets[slot] = node->children.get(i, j, k);
+                if(targets[slot] == nullptr) {
+                    targets[slot] = node->context->nodes.create(node, node->childBox(i, j, k), bucket.back());
+                    node->children.set(i, j, k, targets[slot]);
+                    node->childCount++;
+                    bucket.pop_back();
                 }
             }
         }
-        else {
-            if(parent == nullptr) parent = new CubeTree(this);
-            return parent->insert(data);
+
+        for(std::size_t slot{0}; slot < buckets.size(); slot++) {
+            auto& bucket{buckets[slot]};
+            if(bucket.empty()) continue;
+            CubeTree* child{targets[slot]};
+            if(bucket.size() < BatchGrain) {
+                insertPartition(child, std::move(bucket), tasks);
+            } else {
+                tasks.run([child, bucket{std::move(bucket)}, &tasks]() mutable {
+                    insertPartition(child, std::move(bucket), tasks);
+                });
+            }
+        }
+    }
+
+    // Builds the subtree of an empty node from items, which all lie inside it. items is reordered by
+    // child slot through scratch (same size) and every child is created once with its final content.
+    // Loose entries too large for their child sort behind the slots and stay in node
+    static void buildNode(CubeTree* node, std::span<Handle> items, std::span<Handle> scratch, ThreadPool::TaskGroup& tasks) {
+        if(items.size() <= MaxT || !node->canSplit()) {
+            node->data.reserve(items.size());
+            for(const auto& data : items) node->store(data);
+            return;
+        }
+
+        // Counting sort by child slot
+        constexpr std::size_t Kept{Slots};
+        std::vector<std::uint32_t> slots(items.size());
+        std::size_t offsets[Kept + 2]{};
+        for(std::size_t index{0}; index < items.size(); index++) {
+            const auto [i, j, k]{node->slotOf(Traits::position(items[index]))};
+            slots[index] = node->fitsChild(items[index], i, j, k) ? static_cast<std::uint32_t>((i * N + j) * NZ + k) : static_cast<std::uint32_t>(Kept);
+            offsets[slots[index] + 1]++;
+        }
+        for(std::size_t slot{0}; slot <= Kept; slot++) offsets[slot + 1] += offsets[slot];
+        {
+            std::size_t cursor[Kept + 1];
+            std::copy(offsets, offsets + Kept + 1, cursor);
+            for(std::size_t index{0}; index < items.size(); index++) scratch[cursor[slots[index]]++] = std::move(items[index]);
+        }
+        for(std::size_t index{offsets[Kept]}; index < offsets[Kept + 1]; index++) node->store(scratch[index]);
+
+        for(std::size_t slot{0}; slot < Slots; slot++) {
+            const std::size_t first{offsets[slot]}, count{offsets[slot + 1] - offsets[slot]};
+            if(count == 0) continue;
+            const std::uint8_t i{static_cast<std::uint8_t>(slot / (N * NZ))};
+            const std::uint8_t j{static_cast<std::uint8_t>((slot / NZ) % N)};
+            const std::uint8_t k{static_cast<std::uint8_t>(slot % NZ)};
+            CubeTree* child{node->context->nodes.create(node, node->childBox(i, j, k))};
+            node->children.set(i, j, k, child);
+            node->childCount++;
+
+            // The sorted run lives in scratch now, the vacated part of items serves as its scratch
+            const std::span<Handle> run{scratch.subspan(first, count)}, runScratch{items.subspan(first, count)};
+            if(count < BatchGrain) {
+                buildNode(child, run, runScratch, tasks);
+            } else {
+                tasks.run([child, run, runScratch, &tasks]() { buildNode(child, run, runScratch, tasks); });
+            }
+        }
+    }
+
+public:
+    // Function to build a whole tree from entities in one pass: the bounds are computed once,
+    // entities are partitioned by child slot top down and the subtrees are built in parallel.
+    // The caller owns the returned root and deletes it like one created with new
+    static CubeTree* build(std::span<const Handle> entities, const std::uint16_t& threads) {
+        return build(ThreadPool::shared(), threads, entities);
+    }
+
+    static CubeTree* build(ThreadPool& pool, const std::uint16_t& threads, std::span<const Handle> entities) {
+        if(entities.empty()) throw std::invalid_argument("Cannot build a tree without entries!");
+
+        glm::vec<3, FType, glm::defaultp> min{Traits::position(entities.front())}, max{min};
+        for(const auto& entity : entities) {
+            min = glm::min(min, Traits::position(entity));
+            max = glm::max(max, Traits::position(entity));
+        }
+        const glm::vec<3, FType, glm::defaultp> extent{max - min};
+        FType length{std::max({extent.x, extent.y, (Axes == 3) ? extent.z : FType{0}})};
+        if constexpr (Options::loose) {
+            // Room for the largest sphere in the slack, which is (looseness - 1) / 2 box lengths wide
+            FType radius{0};
+            for(const auto& entity : entities) radius = std::max(radius, static_cast<FType>(Traits::radius(entity)));
+            length = std::max(length, 2 * radius / static_cast<FType>(Options::looseness - 1));
+        }
+        // Pad the cube slightly so the points on the max faces are inside after rounding
+        length = (length > 0) ? length * (1 + 64 * std::numeric_limits<FType>::epsilon()) : static_cast<FType>(1);
+
+        CubeTree* root{new CubeTree(BBox{(min + max) / static_cast<FType>(2), length})};
+        root->context->reserve(entities.size());
+        std::vector<Handle> items(entities.begin(), entities.end()), scratch(entities.size());
+        {
+            ThreadPool::TaskGroup tasks(pool, threads);
+            buildNode(root, items, scratch, tasks);
+            tasks.wait();
+        }
+        return root;
+    }
+
+    // Function to insert many entries at once, returns the topmost node afterwards
+    CubeTree* insertBatch(std::span<Handle> batch) {
+        return insertBatch(ThreadPool::shared().size(), batch);
+    }
+
+    CubeTree* insertBatch(const std::uint16_t& threads, std::span<Handle> batch) {
+        return insertBatch(ThreadPool::shared(), threads, batch);
+    }
+
+    // Same as above but schedules the partitions onto the given pool, at most `threads` at a time
+    CubeTree* insertBatch(ThreadPool& pool, const std::uint16_t& threads, std::span<Handle> batch) {
+        context->edited();
+        std::vector<Handle> contained;
+        contained.reserve(batch.size());
+        CubeTree* root{this};
+        for(auto& data : batch) {
+            if(holds(data)) {
+                contained.push_back(data);
+            } else {
+                // Entries outside grow the tree, which has to happen one at a time
+                root = root->insert(data);
+            }
+        }
+
+        if(!contained.empty()) {
+            ThreadPool::TaskGroup tasks(pool, threads);
+            insertPartition(this, std::move(contained), tasks);
+            tasks.wait();
+        }
+
+        // Ensure root is the topmost parent node
+        while (root->parent != nullptr) {
+            root = root->parent;
+        }
+
+        return root;
+    }
+
+    // Function to remove data from the tree, returns false if it is not stored in it
+    bool remove(const Handle& data) {
+        const Key key{Traits::key(data)};
+        CubeTree* node{context->find(key)};
+        while(node != nullptr) {
+            {
+                const auto lock{node->exclusiveLock()};
+                auto it{std::find_if(node->data.begin(), node->data.end(), [&key](const Handle& entry) { return Traits::key(entry) == key; })};
+                if(it != node->data.end()) {
+                    node->eraseAt(static_cast<std::size_t>(it - node->data.begin()));
+                    context->forget(key);
+                    context->edited();
+                    return true;
+                }
+            }
+            // A concurrent split moved it between the lookup and the lock, follow the new entry
+            CubeTree* moved{context->find(key)};
+            if(moved == node) return false;
+            node = moved;
+        }
+        return false;
+    }
+
+    // Function to insert data into the tree
+    CubeTree* insert(Handle data) {
+        context->edited();
+        {
+            std::unique_lock<std::shared_mutex> lock{exclusiveLock()};
+            if(parent == nullptr) {
+                checkEntry(data);
+                while(!holds(data)) grow(Traits::position(data));
+            }
+            if(holds(data)) {
+                insertDescend(data, std::move(lock));
+                return this;
+            }
         }
-        return this;
+        return parent->insert(data);
     }
 };
 
@@ -0,0 +1,281 @@
+#ifndef NCUBEDTREE_CUBETREEIMAGE_HPP_
+#define NCUBEDTREE_CUBETREEIMAGE_HPP_
+
+#include "vendor/glm/glm/glm.hpp"
+#include <vector>
+#include <string>
+#include <ostream>
+#include <span>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <concepts>
+#include "CubeTree.hpp"
+
+#if defined(_WIN32)
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+// Binary image of a built CubeTree and a read-only view that queries it in place. The image is a
+// header, the nodes in breadth-first order (children of a node are contiguous) and the entries of
+// all nodes as 64-bit ids with their positions inline. It is written in native byte order and the
+// view refuses images of another byte order, FType or layout version. Node boxes of a 2D tree bound
+// x and y only.
+template<typename FType = double>
+class CubeTreeImage {
+public:
+    static constexpr std::uint32_t Magic{0x4254434e};     // "NCTB"
+    static constexpr std::uint32_t Version{2};
+    static constexpr std::uint32_t ByteOrder{0x01020304};
+
+    typedef struct Header {
+        std::uint32_t magic;
+        std::uint32_t version;
+        std::uint32_t byteOrder;
+        std::uint8_t ftypeSize;
+        std::uint8_t n;
+        std::uint8_t dimensions;
+        std::uint8_t reserved;
+        std::uint64_t nodeCount;
+        std::uint64_t entryCount;
+    } Header;
+
+    // A node with its query box (inflated in loose mode), its children and its entries
+    typedef struct Node {
+        FType center[3];
+        FType length;
+        std::uint32_t firstChild;
+        std::uint32_t childCount;
+        std::uint32_t firstEntry;
+        std::uint32_t entryCount;
+    } Node;
+
+    // With a float FType the entry ends in 4 bytes of padding, write() zeroes them
+    typedef struct Entry {
+        std::uint64_t id;
+        FType position[3];
+    } Entry;
+
+    static_assert(sizeof(Header) == 3 * sizeof(std::uint32_t) + 4 + 2 * sizeof(std::uint64_t), "Image header must not have padding!");
+    static_assert(sizeof(Node) == 4 * sizeof(FType) + 4 * sizeof(std::uint32_t), "Image node must not have padding!");
+
+    // Function to write the tree below root as an image, id(handle) gives the 64-bit id stored for an
+    // entity. The tree must not be modified while it is written
+    template<std::uint8_t N, std::uint16_t MaxT, typename T, typename F, template<typename> class A, typename O, typename Tr, typename IdOf>
+        requires std::invocable<IdOf&, const typename CubeTree<N, MaxT, T, F, A, O, Tr>::Handle&>
+    static void write(std::ostream& out, const CubeTree<N, MaxT, T, F, A, O, Tr>* root, IdOf&& id) {
+        typedef CubeTree<N, MaxT, T, F, A, O, Tr> Tree;
+        std::vector<const Tree*> order{root};
+        std::vector<Node> nodes;
+        std::vector<Entry> entries;
+        for(std::size_t index{0}; index < order.size(); index++) {
+            const Tree* node{order[index]};
+            const typename Tree::BBox box{Tree::bounds(node->worldBox())};
+            // Records are filled in place after zeroing so no padding byte reaches the image uninitialised
+            Node& record{nodes.emplace_back()};
+            std::memset(&record, 0, sizeof(Node));
+            for(glm::length_t axis{0}; axis < 3; axis++) record.center[axis] = static_cast<FType>(box.center[axis]);
+            record.length = static_cast<FType>(box.length);
+            record.firstChild = static_cast<std::uint32_t>(order.size());
+            record.firstEntry = static_cast<std::uint32_t>(entries.size());
+            record.entryCount = static_cast<std::uint32_t>(node->data.size());
+            for(const auto& data : node->data) {
+                const auto& pos{Tree::positionOf(data)};
+                Entry& entry{entries.emplace_back()};
+                std::memset(&entry, 0, sizeof(Entry));
+                entry.id = static_cast<std::uint64_t>(id(data));
+                for(glm::length_t axis{0}; axis < 3; axis++) entry.position[axis] = static_cast<FType>(pos[axis]);
+            }
+            for(std::uint8_t i{0}; i < N; i++) {
+                for(std::uint8_t j{0}; j < N; j++) {
+                    for(std::uint8_t k{0}; k < Tree::NZ; k++) {
+                        if(node->children.get(i, j, k) != nullptr) {
+                            order.push_back(node->children.get(i, j, k));
+                            record.childCount++;
+                        }
+                    }
+                }
+            }
+        }
+        if(order.size() > UINT32_MAX || entries.size() > UINT32_MAX) throw std::invalid_argument("Tree is too large for an image!");
+
+        const Header header{Magic, Version, ByteOrder, static_cast<std::uint8_t>(sizeof(FType)), N, static_cast<std::uint8_t>(Tree::Axes), 0, nodes.size(), entries.size()};
+        out.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+        out.write(reinterpret_cast<const char*>(nodes.data()), static_cast<std::streamsize>(sizeof(Node) * nodes.size()));
+        out.write(reinterpret_cast<const char*>(entries.data()), static_cast<std::streamsize>(sizeof(Entry) * entries.size()));
+        if(!out) throw std::runtime_error("Failed to write the tree image!");
+    }
+
+    // View over an image in memory, usually a MappedFile. Nothing is copied, bytes must stay valid
+    // and unchanged while the view is used. The layout is checked once here
+    explicit CubeTreeImage(std::span<const std::byte> bytes) {
+        if(bytes.size() < sizeof(Header) || reinterpret_cast<std::uintptr_t>(bytes.data()) % alignof(Node) != 0) throw std::invalid_argument("Not a tree image!");
+        const Header* header{reinterpret_cast<const Header*>(bytes.data())};
+        if(header->magic != Magic || header->version != Version) throw std::invalid_argument("Not a tree image!");
+        if(header->byteOrder != ByteOrder || header->ftypeSize != sizeof(FType)) throw std::invalid_argument("Tree image has another byte order or FType!");
+        if(header->dimensions != 2 && header->dimensions != 3) throw std::invalid_argument("Tree image is corrupt!");
+        if(header->nodeCount == 0 || header->nodeCount > UINT32_MAX || header->entryCount > UINT32_MAX ||
+            bytes.size() != sizeof(Header) + sizeof(Node) * header->nodeCount + sizeof(Entry) * header->entryCount) throw std::invalid_argument("Tree image is truncated!");
+
+        axes = header->dimensions;
+        nodes = {reinterpret_cast<const Node*>(bytes.data() + sizeof(Header)), static_cast<std::size_t>(header->nodeCount)};
+        entries = {reinterpret_cast<const Entry*>(bytes.data() + sizeof(Header) + sizeof(Node) * nodes.size()), static_cast<std::size_t>(header->entryCount)};
+        for(std::size_t index{0}; index < nodes.size(); index++) {
+            const Node& node{nodes[index]};
+            if((node.childCount != 0 && node.firstChild <= index) || std::uint64_t{node.firstChild} + node.childCount > nodes.size() ||
+                std::uint64_t{node.firstEntry} + node.entryCount > entries.size()) throw std::invalid_argument("Tree image is corrupt!");
+        }
+    }
+
+    std::span<const Node> allNodes() const {
+        return nodes;
+    }
+
+    std::span<const Entry> allEntries() const {
+        return entries;
+    }
+
+    // Function to call func with every entry of the image
+    template<typename F> requires std::invocable<F&, const Entry&>
+    void forEach(F&& func) const {
+        for(const Entry& entry : entries) func(entry);
+    }
+
+    // Function to call visitor with every entry within range of center
+    template<typename F> requires std::invocable<F&, const Entry&>
+    void queryRange(const glm::vec<3, FType, glm::defaultp>& center, const FType& range, F&& visitor) const {
+        const FType range2{range * range};
+        walk([&](const Node& node) {
+            const FType reach{node.length / 2 + range};
+            return std::abs(center.x - node.center[0]) <= reach && std::abs(center.y - node.center[1]) <= reach && (axes == 2 || std::abs(center.z - node.center[2]) <= reach);
+        }, [&](const Entry& entry) {
+            const FType dx{entry.position[0] - center.x}, dy{entry.position[1] - center.y}, dz{entry.position[2] - center.z};
+            if(dx * dx + dy * dy + dz * dz <= range2) visitor(entry);
+        });
+    }
+
+    void queryRange(const glm::vec<3, FType, glm::defaultp>& center, const FType& range, std::vector<std::uint64_t>& ids) const {
+        queryRange(center, range, [&ids](const Entry& entry) { ids.push_back(entry.id); });
+    }
+
+    // Function to call visitor with every entry inside the axis-aligned box [min, max]
+    template<typename F> requires std::invocable<F&, const Entry&>
+    void queryBox(const glm::vec<3, FType, glm::defaultp>& min, const glm::vec<3, FType, glm::defaultp>& max, F&& visitor) const {
+        walk([&](const Node& node) {
+            const FType halfBl{node.length / 2};
+            for(glm::length_t axis{0}; axis < axes; axis++) {
+                if(node.center[axis] + halfBl < min[axis] || node.center[axis] - halfBl > max[axis]) return false;
+            }
+            return true;
+        }, [&](const Entry& entry) {
+            for(glm::length_t axis{0}; axis < 3; axis++) {
+                if(entry.position[axis] < min[axis] || entry.position[axis] > max[axis]) return;
+            }
+            visitor(entry);
+        });
+    }
+
+    void queryBox(const glm::vec<3, FType, glm::defaultp>& min, const glm::vec<3, FType, glm::defaultp>& max, std::vector<std::uint64_t>& ids) const {
+        queryBox(min, max, [&ids](const Entry& entry) { ids.push_back(entry.id); });
+    }
+
+private:
+    // Depth-first walk over the nodes that pass enter, handing each of their entries to visit
+    template<typename Enter, typename Visit>
+    void walk(const Enter& enter, const Visit& visit) const {
+        std::vector<std::uint32_t> pending{0};
+        while(!pending.empty()) {
+            const Node& node{nodes[pending.back()]};
+            pending.pop_back();
+            if(!enter(node)) continue;
+            for(std::uint32_t index{node.firstEntry}; index < node.firstEntry + node.entryCount; index++) visit(entries[index]);
+            for(std::uint32_t child{0}; child < node.childCount; child++) pending.push_back(node.firstChild + child);
+        }
+    }
+
+    std::span<const Node> nodes;
+    std::span<const Entry> entries;
+
+    // Axes the node boxes bound, from the header
+    glm::length_t axes{3};
+};
+
+// Read-only memory mapping of a whole file, closed again when destroyed
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) {
+#if defined(_WIN32)
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if(file == INVALID_HANDLE_VALUE) throw std::runtime_error("Cannot open " + path);
+        LARGE_INTEGER fileSize;
+        if(!GetFileSizeEx(file, &fileSize)) {
+            CloseHandle(file);
+            throw std::runtime_error("Cannot stat " + path);
+        }
+        length = static_cast<std::size_t>(fileSize.QuadPart);
+        if(length != 0) {
+            mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            address = (mapping != nullptr) ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+            if(address == nullptr) {
+                if(mapping != nullptr) CloseHandle(mapping);
+                CloseHandle(file);
+                throw std::runtime_error("Cannot map " + path);
+            }
+        }
+#else
+        const int fd{::open(path.c_str(), O_RDONLY)};
+        if(fd < 0) throw std::runtime_error("Cannot open " + path);
+        struct stat info;
+        if(::fstat(fd, &info) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Cannot stat " + path);
+        }
+        length = static_cast<std::size_t>(info.st_size);
+        if(length != 0) {
+            address = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(address == MAP_FAILED) {
+                address = nullptr;
+                ::close(fd);
+                throw std::runtime_error("Cannot map " + path);
+            }
+        }
+        ::close(fd);
+#endif
+    }
+
+    ~MappedFile() {
+#if defined(_WIN32)
+        if(address != nullptr) UnmapViewOfFile(address);
+        if(mapping != nullptr) CloseHandle(mapping);
+        CloseHandle(file);
+#else
+        if(address != nullptr) ::munmap(address, length);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    std::span<const std::byte> bytes() const {
+        return {static_cast<const std::byte*>(address), length};
+    }
+
+private:
+#if defined(_WIN32)
+    HANDLE file{INVALID_HANDLE_VALUE};
+    HANDLE mapping{nullptr};
+#endif
+    void* address{nullptr};
+    std::size_t length{0};
+};
+
+#endif
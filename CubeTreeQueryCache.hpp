@@ -0,0 +1,126 @@
+#ifndef NCUBEDTREE_CUBETREEQUERYCACHE_HPP_
+#define NCUBEDTREE_CUBETREEQUERYCACHE_HPP_
+
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <cmath>
+#include "CubeTree.hpp"
+
+// Cache for range queries repeated every tick from nearly the same place, an agent's perception
+// radius for example. Each query id keeps the entities within range + slack of the center it was
+// last answered from the tree at. While the center stays within slack of that point, the range is
+// unchanged and no entity moved into the inflated sphere, the answer is picked from those entities
+// instead of traversing the tree. Moves are checked against the log update keeps, so the tree needs
+// Options::queryCache; any insert or remove drops every cached entry. Answers match the tree as of
+// its last update. One tree per cache, not safe for concurrent use
+template<std::uint8_t N, std::uint16_t MaxT, typename T, typename FType = double, template<typename> class NodeAllocator = NodePool, typename Options = CubeTreeOptions, typename Traits = EntityTraits<T>>
+class CubeTreeQueryCache {
+public:
+    typedef CubeTree<N, MaxT, T, FType, NodeAllocator, Options, Traits> Tree;
+    typedef typename Tree::Handle Handle;
+    typedef std::uint64_t QueryId;
+
+    static_assert(Options::queryCache, "CubeTreeQueryCache needs a tree with Options::queryCache!");
+
+    explicit CubeTreeQueryCache(const FType& slack) :
+        slack(slack) {
+        if(!std::isfinite(slack) || slack < 0) throw std::invalid_argument("Query cache slack is negative or not finite!");
+    }
+
+    // Function to call visitor with every entity within range of center, as root->queryRange would,
+    // answered from the entry of id when it still holds
+    template<typename F> requires std::invocable<F&, const Handle&>
+    void queryRange(Tree* root, const QueryId& id, const glm::vec<3, FType, glm::defaultp>& center, const FType& range, F&& visitor) {
+        const typename Tree::MoveLog& log{root->moveLog()};
+        if(sortedUpdate != log.updates) sortMoves(log);
+
+        Entry& entry{entries[id]};
+        if(valid(entry, log, center, range)) {
+            // Still holds as of this update, the next one only has to check its own moves
+            entry.updates = log.updates;
+            cacheHits++;
+        } else {
+            cacheMisses++;
+            entry.filled = true;
+            entry.center = center;
+            entry.range = range;
+            entry.updates = log.updates;
+            entry.edits = log.edits.load(std::memory_order_relaxed);
+            entry.candidates.clear();
+            root->queryRange(center, range + slack, [&entry](const Handle& entity) { entry.candidates.push_back(entity); });
+        }
+
+        for(const auto& entity : entry.candidates) {
+            if(glm::distance(center, Traits::position(entity)) <= range) visitor(entity);
+        }
+    }
+
+    void queryRange(Tree* root, const QueryId& id, const glm::vec<3, FType, glm::defaultp>& center, const FType& range, std::vector<Handle>& results) {
+        queryRange(root, id, center, range, [&results](const Handle& entity) { results.push_back(entity); });
+    }
+
+    // Function to drop the entry of a query that will not be asked again
+    void forget(const QueryId& id) {
+        entries.erase(id);
+    }
+
+    void clear() {
+        entries.clear();
+    }
+
+    // Queries answered from the cache and by traversing the tree
+    const std::uint64_t& hits() const {
+        return cacheHits;
+    }
+
+    const std::uint64_t& misses() const {
+        return cacheMisses;
+    }
+
+private:
+    typedef struct Entry {
+        glm::vec<3, FType, glm::defaultp> center;
+        FType range{0};
+        std::uint64_t updates{0};
+        std::uint64_t edits{0};
+        std::vector<Handle> candidates;
+        bool filled{false};
+    } Entry;
+
+    // Whether entry still holds every entity within range of center: nothing was inserted or removed,
+    // at most one update ran since it was filled and none of that update's moves entered its sphere
+    const bool valid(const Entry& entry, const typename Tree::MoveLog& log, const glm::vec<3, FType, glm::defaultp>& center, const FType& range) const {
+        if(!entry.filled || entry.range != range || entry.edits != log.edits.load(std::memory_order_relaxed)) return false;
+        if(glm::distance(center, entry.center) > slack) return false;
+        if(entry.updates == log.updates) return true;
+        if(entry.updates + 1 != log.updates) return false;
+
+        // Moves are ordered by their new x, only the ones ending within reach of the sphere can enter it
+        const FType reach{entry.range + slack};
+        auto it{std::lower_bound(moves.begin(), moves.end(), entry.center.x - reach, [](const typename Tree::Move& move, const FType& x) { return move.to.x < x; })};
+        for(; it != moves.end() && it->to.x <= entry.center.x + reach; it++) {
+            if(glm::distance(entry.center, it->to) <= reach && glm::distance(entry.center, it->from) > reach) return false;
+        }
+        return true;
+    }
+
+    void sortMoves(const typename Tree::MoveLog& log) {
+        moves.assign(log.moves.begin(), log.moves.end());
+        std::sort(moves.begin(), moves.end(), [](const typename Tree::Move& a, const typename Tree::Move& b) { return a.to.x < b.to.x; });
+        sortedUpdate = log.updates;
+    }
+
+    FType slack;
+    std::unordered_map<QueryId, Entry> entries;
+
+    // Moves of the last update ordered by their new x, and which update that was
+    std::vector<typename Tree::Move> moves;
+    std::uint64_t sortedUpdate{UINT64_MAX};
+
+    std::uint64_t cacheHits{0}, cacheMisses{0};
+};
+
+#endif
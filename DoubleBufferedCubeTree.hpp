@@ -0,0 +1,198 @@
+#ifndef NCUBEDTREE_DOUBLEBUFFEREDCUBETREE_HPP_
+#define NCUBEDTREE_DOUBLEBUFFEREDCUBETREE_HPP_
+
+#include <memory>
+#include <mutex>
+#include <span>
+#include <vector>
+#include <atomic>
+#include <utility>
+#include <unordered_map>
+#include <type_traits>
+#include "CubeTree.hpp"
+
+// Double-buffered CubeTree for overlapping readers and a writer. Two persistent trees take turns:
+// readers query the published front one for as long as they hold it, while update brings the back
+// one up to date and publishes it with a single pointer swap. The back tree missed the changes of
+// the update before, so it is given those and the new ones and then goes through the ordinary
+// CubeTree::update, with Options::markedMoves only visiting the entities that moved. Each tree
+// stores copies of the positions (and radii in loose mode) as of its last update, so queries never
+// read the live entities while the writer moves them. A back tree still held by a reader is left
+// to it and replaced by a fresh build from the front entries. There is one writer; versions are
+// read-only, only query them
+template<std::uint8_t N, std::uint16_t MaxT, typename T, typename FType = double, template<typename> class NodeAllocator = NodePool, typename Options = CubeTreeOptions, typename Traits = EntityTraits<T>>
+class DoubleBufferedCubeTree {
+public:
+    typedef typename Traits::Handle Handle;
+    typedef typename Traits::Key Key;
+
+    struct NoRadius {};
+
+    // What a version stores per entity, the version's nodes point at these
+    typedef struct Entry {
+        Handle entity;
+        glm::vec<3, FType, glm::defaultp> position;
+        glm::vec<3, FType, glm::defaultp> prevPosition;
+        [[no_unique_address]] std::conditional_t<Options::loose, FType, NoRadius> radius;
+    } Entry;
+
+    // Reads the copied positions of an entry and forwards identity to the entity's own traits
+    struct EntryTraits {
+        typedef Entry* Handle;
+        typedef typename Traits::Key Key;
+        typedef typename Traits::Ref Ref;
+
+        static const glm::vec<3, FType, glm::defaultp>& position(const Entry* entry) { return entry->position; }
+        static const glm::vec<3, FType, glm::defaultp>& prevPosition(const Entry* entry) { return entry->prevPosition; }
+        static decltype(auto) name(const Entry* entry) { return Traits::name(entry->entity); }
+        static FType radius(const Entry* entry) { return entry->radius; }
+        static void settle(Entry* entry) { entry->prevPosition = entry->position; }
+
+        template<typename Vec>
+        static void setPosition(Entry* entry, const Vec& pos) { entry->position = pos; }
+
+        static Key key(const Entry* entry) { return Traits::key(entry->entity); }
+        static Ref ref(const Entry* entry) { return Traits::ref(entry->entity); }
+    };
+
+    typedef CubeTree<N, MaxT, T, FType, NodeAllocator, Options, EntryTraits> Version;
+
+    DoubleBufferedCubeTree() = default;
+
+    DoubleBufferedCubeTree(const DoubleBufferedCubeTree&) = delete;
+    DoubleBufferedCubeTree& operator=(const DoubleBufferedCubeTree&) = delete;
+
+    // Function to get the published version, nullptr before the first update or while there are no entities
+    std::shared_ptr<Version> current() const {
+        std::lock_guard<std::mutex> lock(publishMtx);
+        return published;
+    }
+
+    // Functions to queue an entity to be added, taken out or moved with the next update. Marking an
+    // entity that did not move, or more than once, is harmless
+    void insert(const Handle& entity) {
+        changes.emplace_back(Change::Insert, entity);
+    }
+
+    void remove(const Handle& entity) {
+        changes.emplace_back(Change::Remove, entity);
+    }
+
+    void markMoved(const Handle& entity) {
+        changes.emplace_back(Change::Move, entity);
+    }
+
+    void update(const std::uint16_t& threads) {
+        update(ThreadPool::shared(), threads);
+    }
+
+    // Applies the queued changes to the back tree on the given pool, at most `threads` tasks at a
+    // time, and publishes it. Readers of the previous version are not waited for. Throws like
+    // CubeTree::update when a moved entity cannot be stored, the queued changes are kept then
+    void update(ThreadPool& pool, const std::uint16_t& threads) {
+        std::shared_ptr<Buffer>& back{buffers[1]};
+        if(back == nullptr || !back->released.load(std::memory_order_acquire)) {
+            // Still read, leave it to its readers and start from what the front tree holds
+            back = std::make_shared<Buffer>();
+            if(buffers[0] != nullptr) back->entries = buffers[0]->entries;
+        }
+
+        apply(*back, back->pending);
+        apply(*back, changes);
+        if(back->entries.empty()) {
+            delete back->root;
+            back->root = nullptr;
+        } else if(back->root == nullptr) {
+            std::vector<Entry*> all;
+            all.reserve(back->entries.size());
+            for(auto& [key, entry] : back->entries) {
+                entry.prevPosition = entry.position;
+                all.push_back(&entry);
+            }
+            back->root = Version::build(pool, threads, std::span<Entry* const>(all));
+        } else {
+            back->root = Version::update(pool, threads, back->root);
+        }
+        back->pending.clear();
+        back->retired.clear();
+
+        // The front tree misses exactly this update's changes when its turn comes again
+        if(buffers[0] != nullptr) buffers[0]->pending = std::move(changes);
+        changes.clear();
+        std::swap(buffers[0], buffers[1]);
+        publish(buffers[0]);
+    }
+
+private:
+    enum class Change : std::uint8_t { Insert, Remove, Move };
+
+    // One of the two trees with the entries its nodes point at and the changes it has not seen yet.
+    // Removed entries are retired until the update is done, a mark taken before may still name them.
+    // released is set once no reader holds the version published from it any more
+    struct Buffer {
+        Version* root{nullptr};
+        std::unordered_map<Key, Entry> entries;
+        std::vector<typename std::unordered_map<Key, Entry>::node_type> retired;
+        std::vector<std::pair<Change, Handle>> pending;
+        std::atomic<bool> released{true};
+
+        ~Buffer() {
+            delete root;
+        }
+    };
+
+    static void copyInto(Entry& entry, const Handle& entity) {
+        entry.position = Traits::position(entity);
+        if constexpr (Options::loose) entry.radius = static_cast<FType>(Traits::radius(entity));
+    }
+
+    // Function to bring the entries and tree of buffer in line with changes, the moves are only marked
+    // for the update that follows. Without a tree yet only the entries change
+    static void apply(Buffer& buffer, const std::vector<std::pair<Change, Handle>>& changes) {
+        for(const auto& [change, entity] : changes) {
+            const Key key{Traits::key(entity)};
+            const auto it{buffer.entries.find(key)};
+            if(change == Change::Remove) {
+                if(it == buffer.entries.end()) continue;
+                if(buffer.root != nullptr) buffer.root->remove(&it->second);
+                buffer.retired.push_back(buffer.entries.extract(it));
+            } else if(it != buffer.entries.end()) {
+                copyInto(it->second, entity);
+                if constexpr (Options::markedMoves) {
+                    if(buffer.root != nullptr) buffer.root->markMoved(&it->second);
+                }
+            } else if(change == Change::Insert) {
+                Entry& entry{buffer.entries.emplace(key, Entry{entity, {}, {}, {}}).first->second};
+                copyInto(entry, entity);
+                entry.prevPosition = entry.position;
+                if(buffer.root != nullptr) buffer.root = buffer.root->insert(&entry);
+            }
+        }
+    }
+
+    // The version handed to readers keeps its buffer alive and marks it released when the last
+    // holder lets go. The previous version is released outside the lock, by its last reader if it still has any
+    void publish(const std::shared_ptr<Buffer>& buffer) {
+        std::shared_ptr<Version> next;
+        if(buffer->root != nullptr) {
+            buffer->released.store(false, std::memory_order_relaxed);
+            next = std::shared_ptr<Version>(buffer->root, [buffer](Version*) { buffer->released.store(true, std::memory_order_release); });
+        }
+        {
+            std::lock_guard<std::mutex> lock(publishMtx);
+            published.swap(next);
+        }
+    }
+
+    // Guards only the pointer swap, std::atomic<std::shared_ptr> is not available everywhere yet
+    mutable std::mutex publishMtx;
+    std::shared_ptr<Version> published;
+
+    // Front tree (published) and back tree
+    std::shared_ptr<Buffer> buffers[2];
+
+    // Changes queued since the last update
+    std::vector<std::pair<Change, Handle>> changes;
+};
+
+#endif
@@ -0,0 +1,543 @@
+#ifndef NCUBEDTREE_LINEARCUBETREE_HPP_
+#define NCUBEDTREE_LINEARCUBETREE_HPP_
+
+#include "vendor/glm/glm/glm.hpp"
+#include <vector>
+#include <mutex>
+#include <memory>
+#include <cmath>
+#include <limits>
+#include <unordered_map>
+#include <stdexcept>
+#include <span>
+#include <functional>
+#include <algorithm>
+#include <concepts>
+#include <iterator>
+#include <type_traits>
+#include <bit>
+#include <cstdint>
+#include "ThreadPool.hpp"
+
+// Pointerless counterpart of CubeTree with the same insert/update/queryRange/forEach API. Only the
+// leaves are kept, in one array sorted by the Morton (Z-order) key of their cell, so there are no
+// child pointers, traversals and range queries are linear scans and the cell next to any cell
+// follows from key arithmetic. N must be a power of two. Queries may run concurrently with each
+// other but not with insert, remove or update
+template<std::uint8_t N, std::uint16_t MaxT, typename T, typename FType = double>
+class LinearCubeTree {
+    static_assert(N >= 2 && (N & (N - 1)) == 0, "Morton keys need a power of two N!");
+
+public:
+    typedef std::uint64_t Key;
+
+    // Key bits per axis and level, the deepest level and the key bits per axis at that level
+    static constexpr std::uint8_t LevelBits{static_cast<std::uint8_t>(std::bit_width(static_cast<unsigned int>(N)) - 1)};
+    static constexpr std::uint8_t MaxDepth{static_cast<std::uint8_t>(21 / LevelBits)};
+    static constexpr std::uint8_t AxisBits{static_cast<std::uint8_t>(LevelBits * MaxDepth)};
+
+    // Cells per axis at MaxDepth and the first key past the whole box
+    static constexpr Key Cells{Key{1} << AxisBits};
+    static constexpr Key KeyEnd{Key{1} << (3 * AxisBits)};
+
+    // Subtrees holding at most this many entries are merged back into one leaf by compact
+    static constexpr std::uint16_t MergeT{MaxT / 2};
+
+    typedef struct BBox {
+        glm::vec<3, FType, glm::defaultp> center;
+        FType length;
+    } BBox;
+
+    // A cell holding entries, it covers the keys [key, key + span(depth)). codes holds the key of
+    // every entry as of its last insert or update, index aligned with data
+    typedef struct Leaf {
+        Key key;
+        std::uint8_t depth;
+        std::vector<std::shared_ptr<T>> data;
+        std::vector<Key> codes;
+    } Leaf;
+
+    explicit LinearCubeTree(const BBox& box) :
+        box(box) {
+        if(!(box.length > 0) || !std::isfinite(box.length)) throw std::invalid_argument("Tree box length must be positive and finite!");
+    }
+
+    static const bool inside(const BBox& box, const glm::vec<3, FType, glm::defaultp>& pos) {
+        const FType halfBl{box.length / 2};
+        return (pos.x >= (box.center.x - halfBl) && pos.x <= (box.center.x + halfBl)) &&
+            (pos.y >= (box.center.y - halfBl) && pos.y <= (box.center.y + halfBl)) &&
+            (pos.z >= (box.center.z - halfBl) && pos.z <= (box.center.z + halfBl));
+    }
+
+    // Number of keys covered by a cell at depth
+    static constexpr Key span(const std::uint8_t& depth) {
+        return Key{1} << (3 * LevelBits * (MaxDepth - depth));
+    }
+
+    // Key of the MaxDepth cell containing pos, positions outside the box are clamped onto its faces
+    const Key keyOf(const glm::vec<3, FType, glm::defaultp>& pos) const {
+        const FType scale{static_cast<FType>(Cells) / box.length};
+        const FType halfBl{box.length / 2};
+        Key key{0};
+        for(glm::length_t axis{0}; axis < 3; axis++) {
+            const FType scaled{(pos[axis] - (box.center[axis] - halfBl)) * scale};
+            const Key cell{!(scaled > 0) ? Key{0} : (scaled >= static_cast<FType>(Cells - 1) ? Cells - 1 : static_cast<Key>(scaled))};
+            key |= spread(cell) << (2 - axis);
+        }
+        return key;
+    }
+
+    // Bounding box of the cell at depth starting at key
+    const BBox cellBox(const Key& key, const std::uint8_t& depth) const {
+        const FType unit{box.length / static_cast<FType>(Cells)};
+        const FType length{unit * static_cast<FType>(Key{1} << (LevelBits * (MaxDepth - depth)))};
+        const FType halfBl{box.length / 2};
+        glm::vec<3, FType, glm::defaultp> center;
+        for(glm::length_t axis{0}; axis < 3; axis++) {
+            center[axis] = box.center[axis] - halfBl + unit * static_cast<FType>(gather(key >> (2 - axis))) + length / 2;
+        }
+        return {center, length};
+    }
+
+    const BBox& bounds() const {
+        return box;
+    }
+
+    const std::vector<Leaf>& cells() const {
+        return leaves;
+    }
+
+    std::size_t size() const {
+        return entries.size();
+    }
+
+    // Leaf holding entity, or nullptr if it is not in the tree
+    const Leaf* findLeaf(const std::shared_ptr<T>& entity) const {
+        const auto it{entries.find(entity.get())};
+        if(it == entries.end()) return nullptr;
+        const std::size_t index{locate(it->second)};
+        return (index != leaves.size()) ? &leaves[index] : nullptr;
+    }
+
+    // Leaf covering pos, or nullptr if no leaf does
+    const Leaf* leafAt(const glm::vec<3, FType, glm::defaultp>& pos) const {
+        if(!inside(box, pos)) return nullptr;
+        const std::size_t index{locate(keyOf(pos))};
+        return (index != leaves.size()) ? &leaves[index] : nullptr;
+    }
+
+    // Function to find the leaf next to leaf, offset by (dx, dy, dz) cells of leaf's own size. The
+    // neighbouring cell is found by key arithmetic; the result is the leaf covering its first key,
+    // which may be coarser than leaf, or nullptr when that cell is empty or outside the box
+    const Leaf* neighbour(const Leaf& leaf, const int& dx, const int& dy, const int& dz) const {
+        const std::int64_t step{static_cast<std::int64_t>(Key{1} << (LevelBits * (MaxDepth - leaf.depth)))};
+        const int offset[3]{dx, dy, dz};
+        Key key{0};
+        for(glm::length_t axis{0}; axis < 3; axis++) {
+            const std::int64_t cell{static_cast<std::int64_t>(gather(leaf.key >> (2 - axis))) + offset[axis] * step};
+            if(cell < 0 || cell >= static_cast<std::int64_t>(Cells)) return nullptr;
+            key |= spread(static_cast<Key>(cell)) << (2 - axis);
+        }
+        const std::size_t index{locate(key)};
+        return (index != leaves.size()) ? &leaves[index] : nullptr;
+    }
+
+    // Function to insert data into the tree, the box grows N-fold towards entries outside it
+    void insert(std::shared_ptr<T> data) {
+        const auto& pos{data->m_position};
+        if(!std::isfinite(pos.x) || !std::isfinite(pos.y) || !std::isfinite(pos.z)) throw std::invalid_argument("Entry position is not finite!");
+        if(!inside(box, pos)) {
+            insertBatch(std::span<std::shared_ptr<T>>(&data, 1));
+            return;
+        }
+
+        const Key key{keyOf(pos)};
+        entries[data.get()] = key;
+        const std::size_t next{upper(key)};
+        if(next != 0 && key - leaves[next - 1].key < span(leaves[next - 1].depth)) {
+            Leaf& leaf{leaves[next - 1]};
+            leaf.data.push_back(std::move(data));
+            leaf.codes.push_back(key);
+            if(leaf.data.size() > MaxT) splitAt(next - 1);
+        } else {
+            // Uncovered key, the new leaf takes the coarsest free cell around it
+            const Key first{(next == 0) ? Key{0} : leaves[next - 1].key + span(leaves[next - 1].depth)};
+            const Key last{(next == leaves.size()) ? KeyEnd : leaves[next].key};
+            const std::uint8_t depth{freeDepth(key, first, last)};
+            leaves.insert(leaves.begin() + static_cast<std::ptrdiff_t>(next), Leaf{key & ~(span(depth) - 1), depth, {std::move(data)}, {key}});
+        }
+    }
+
+    // Function to insert many entries at once: they are sorted by key and merged with the leaves
+    // in one linear pass, after which every over-full leaf is split
+    void insertBatch(std::span<std::shared_ptr<T>> batch) {
+        std::vector<std::pair<Key, std::shared_ptr<T>>> items;
+        for(const auto& data : batch) {
+            const auto& pos{data->m_position};
+            if(!std::isfinite(pos.x) || !std::isfinite(pos.y) || !std::isfinite(pos.z)) throw std::invalid_argument("Entry position is not finite!");
+        }
+
+        // Growing changes every key, so the stored entries are re-keyed along with the batch
+        bool grew{false};
+        for(const auto& data : batch) {
+            while(!inside(box, data->m_position)) {
+                grow(data->m_position);
+                grew = true;
+            }
+        }
+        if(grew) {
+            items.reserve(entries.size() + batch.size());
+            for(auto& leaf : leaves)
+                for(auto& data : leaf.data) items.emplace_back(keyOf(data->m_position), std::move(data));
+            leaves.clear();
+        } else {
+            items.reserve(batch.size());
+        }
+        for(const auto& data : batch) items.emplace_back(keyOf(data->m_position), data);
+        std::sort(items.begin(), items.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+        std::vector<Leaf> merged;
+        merged.reserve(leaves.size() + 1);
+        std::size_t next{0};
+        for(auto& [key, data] : items) {
+            entries[data.get()] = key;
+            // Pass over the leaves that end before key
+            while(next < leaves.size() && leaves[next].key + span(leaves[next].depth) <= key) merged.push_back(std::move(leaves[next++]));
+
+            Leaf* target{nullptr};
+            if(next < leaves.size() && leaves[next].key <= key) {
+                target = &leaves[next];
+            } else if(!merged.empty() && key - merged.back().key < span(merged.back().depth)) {
+                target = &merged.back();
+            } else {
+                const Key first{merged.empty() ? Key{0} : merged.back().key + span(merged.back().depth)};
+                const Key last{(next == leaves.size()) ? KeyEnd : leaves[next].key};
+                const std::uint8_t depth{freeDepth(key, first, last)};
+                merged.push_back(Leaf{key & ~(span(depth) - 1), depth, {}, {}});
+                target = &merged.back();
+            }
+            target->data.push_back(std::move(data));
+            target->codes.push_back(key);
+        }
+        while(next < leaves.size()) merged.push_back(std::move(leaves[next++]));
+
+        leaves.clear();
+        leaves.reserve(merged.size());
+        for(auto& leaf : merged) emit(std::move(leaf), leaves);
+    }
+
+    // Function to remove data from the tree, returns false if it is not stored in it
+    bool remove(const std::shared_ptr<T>& data) {
+        const auto it{entries.find(data.get())};
+        if(it == entries.end()) return false;
+        const std::size_t index{locate(it->second)};
+        entries.erase(it);
+        if(index == leaves.size()) return false;
+        Leaf& leaf{leaves[index]};
+        const auto found{std::find(leaf.data.begin(), leaf.data.end(), data)};
+        if(found == leaf.data.end()) return false;
+        eraseAt(leaf, static_cast<std::size_t>(found - leaf.data.begin()));
+        return true;
+    }
+
+    void update(const std::uint16_t& threads) {
+        update(ThreadPool::shared(), threads);
+    }
+
+    // Settles the entries that moved within their leaf in place and reinserts the ones that left it
+    // as one batch, then compacts. Leaves are scanned in parallel, at most `threads` tasks at a time
+    void update(ThreadPool& pool, const std::uint16_t& threads) {
+        std::vector<std::shared_ptr<T>> escaped;
+        std::vector<std::pair<const T*, Key>> moved;
+        std::mutex collectMutex;
+        {
+            ThreadPool::TaskGroup tasks(pool, threads);
+            for(std::size_t first{0}; first < leaves.size(); first += LeafGrain) {
+                const std::size_t last{std::min(first + LeafGrain, leaves.size())};
+                tasks.run([this, first, last, &escaped, &moved, &collectMutex]() {
+                    collect(first, last, escaped, moved, collectMutex);
+                });
+            }
+            tasks.wait();
+        }
+
+        for(const auto& [entity, key] : moved) entries[entity] = key;
+        if(!escaped.empty()) insertBatch(escaped);
+        compact();
+    }
+
+    // Function to merge cells whose leaves together hold at most MergeT entries into one leaf and to
+    // drop empty leaves, repeated until nothing changes
+    void compact() {
+        bool changed{true};
+        while(changed) {
+            changed = false;
+            std::vector<Leaf> out;
+            out.reserve(leaves.size());
+            for(std::size_t index{0}; index < leaves.size();) {
+                Leaf& leaf{leaves[index]};
+                if(leaf.data.empty()) {
+                    index++;
+                    changed = true;
+                    continue;
+                }
+                if(leaf.depth == 0) {
+                    out.push_back(std::move(leaf));
+                    index++;
+                    continue;
+                }
+
+                // Gather every leaf of the parent cell, the ones before this leaf are already in out
+                const std::uint8_t depth{static_cast<std::uint8_t>(leaf.depth - 1)};
+                const Key first{leaf.key & ~(span(depth) - 1)}, last{first + span(depth)};
+                std::size_t total{leaf.data.size()}, before{0}, end{index + 1};
+                while(before < out.size() && out[out.size() - 1 - before].key >= first) total += out[out.size() - 1 - before++].data.size();
+                while(end < leaves.size() && leaves[end].key < last) total += leaves[end++].data.size();
+                if(total > MergeT) {
+                    out.push_back(std::move(leaf));
+                    index++;
+                    continue;
+                }
+
+                Leaf parent{first, depth, {}, {}};
+                parent.data.reserve(total);
+                parent.codes.reserve(total);
+                const auto absorb{[&parent](Leaf& from) {
+                    std::move(from.data.begin(), from.data.end(), std::back_inserter(parent.data));
+                    parent.codes.insert(parent.codes.end(), from.codes.begin(), from.codes.end());
+                }};
+                for(std::size_t i{out.size() - before}; i < out.size(); i++) absorb(out[i]);
+                out.resize(out.size() - before);
+                for(; index < end; index++) absorb(leaves[index]);
+                out.push_back(std::move(parent));
+                changed = true;
+            }
+            leaves.swap(out);
+        }
+    }
+
+    void forEach(const std::function<bool(std::shared_ptr<T>&)>& func) {
+        forEach<const std::function<bool(std::shared_ptr<T>&)>&>(func);
+    }
+
+    // Same as above without the std::function indirection, func may also return void to visit everything
+    template<typename F> requires std::invocable<F&, std::shared_ptr<T>&>
+    void forEach(F&& func) {
+        for(auto& leaf : leaves) {
+            for(auto& data : leaf.data) {
+                if constexpr (std::is_void_v<std::invoke_result_t<F&, std::shared_ptr<T>&>>) {
+                    func(data);
+                } else {
+                    if(!func(data)) return;
+                }
+            }
+        }
+    }
+
+    void forEachAsync(const std::uint16_t& threads, const std::function<bool(std::shared_ptr<T>&)>& func) {
+        forEachAsync(ThreadPool::shared(), threads, func);
+    }
+
+    // Same as above but schedules runs of leaves onto the given pool, at most `threads` at a time.
+    // A false return from func stops the rest of its leaf
+    void forEachAsync(ThreadPool& pool, const std::uint16_t& threads, const std::function<bool(std::shared_ptr<T>&)>& func) {
+        ThreadPool::TaskGroup tasks(pool, threads);
+        for(std::size_t first{0}; first < leaves.size(); first += LeafGrain) {
+            const std::size_t last{std::min(first + LeafGrain, leaves.size())};
+            tasks.run([this, first, last, &func]() {
+                for(std::size_t index{first}; index < last; index++) {
+                    for(auto& data : leaves[index].data) {
+                        if(!func(data)) break;
+                    }
+                }
+            });
+        }
+        tasks.wait();
+    }
+
+    // Function to query entities within a range around a specified position
+    void queryRange(const std::shared_ptr<T>& entity, const FType& range, std::vector<std::shared_ptr<T>>& results) const {
+        queryRange(entity->m_position, range, results);
+    }
+
+    void queryRange(const glm::vec<3, FType, glm::defaultp>& center, const FType& range, std::vector<std::shared_ptr<T>>& results) const {
+        queryRange(center, range, [&results](const std::shared_ptr<T>& entity) { results.push_back(entity); });
+    }
+
+    // Calls visitor with every entity within range of center. Every leaf meeting the query lies
+    // between the keys of the query cube's min and max corners, that key interval is scanned in
+    // order and leaves whose cell misses the query are skipped
+    template<typename F> requires std::invocable<F&, const std::shared_ptr<T>&>
+    void queryRange(const glm::vec<3, FType, glm::defaultp>& center, const FType& range, F&& visitor) const {
+        if(leaves.empty() || !intersects(center, range, box)) return;
+        const Key first{keyOf(center - glm::vec<3, FType, glm::defaultp>(range))};
+        const Key last{keyOf(center + glm::vec<3, FType, glm::defaultp>(range))};
+        std::size_t index{upper(first)};
+        if(index != 0) index--;
+        for(; index < leaves.size() && leaves[index].key <= last; index++) {
+            const Leaf& leaf{leaves[index]};
+            if(!intersects(center, range, cellBox(leaf.key, leaf.depth))) continue;
+            for(const auto& entity : leaf.data) {
+                if(glm::distance(center, entity->m_position) <= range) {
+                    visitor(entity);
+                }
+            }
+        }
+    }
+
+private:
+    // Leaves handed to one task by update and forEachAsync
+    static constexpr std::size_t LeafGrain{64};
+
+    // Spreads the low 21 bits of v so that two zero bits follow each of them
+    static constexpr Key spread(Key v) {
+        v &= 0x1fffff;
+        v = (v | (v << 32)) & 0x1f00000000ffffull;
+        v = (v | (v << 16)) & 0x1f0000ff0000ffull;
+        v = (v | (v << 8)) & 0x100f00f00f00f00full;
+        v = (v | (v << 4)) & 0x10c30c30c30c30c3ull;
+        v = (v | (v << 2)) & 0x1249249249249249ull;
+        return v;
+    }
+
+    // Inverse of spread, collects every third bit of v starting at the lowest
+    static constexpr Key gather(Key v) {
+        v &= 0x1249249249249249ull;
+        v = (v ^ (v >> 2)) & 0x10c30c30c30c30c3ull;
+        v = (v ^ (v >> 4)) & 0x100f00f00f00f00full;
+        v = (v ^ (v >> 8)) & 0x1f0000ff0000ffull;
+        v = (v ^ (v >> 16)) & 0x1f00000000ffffull;
+        v = (v ^ (v >> 32)) & 0x1fffffull;
+        return v;
+    }
+
+    // Index of the first leaf starting after key
+    const std::size_t upper(const Key& key) const {
+        const auto it{std::upper_bound(leaves.begin(), leaves.end(), key, [](const Key& k, const Leaf& leaf) { return k < leaf.key; })};
+        return static_cast<std::size_t>(it - leaves.begin());
+    }
+
+    // Index of the leaf covering key, leaves.size() if there is none
+    const std::size_t locate(const Key& key) const {
+        const std::size_t next{upper(key)};
+        if(next == 0 || key - leaves[next - 1].key >= span(leaves[next - 1].depth)) return leaves.size();
+        return next - 1;
+    }
+
+    // Depth of the coarsest cell around key that lies within the free keys [first, last)
+    static const std::uint8_t freeDepth(const Key& key, const Key& first, const Key& last) {
+        for(std::uint8_t depth{0}; depth < MaxDepth; depth++) {
+            const Key start{key & ~(span(depth) - 1)};
+            if(start >= first && start + span(depth) <= last) return depth;
+        }
+        return MaxDepth;
+    }
+
+    // Whether the children of a cell at depth would still be distinguishable in FType
+    const bool canSplit(const std::uint8_t& depth) const {
+        const FType extent{std::max({std::abs(box.center.x), std::abs(box.center.y), std::abs(box.center.z), box.length})};
+        const FType childLength{box.length / static_cast<FType>(Key{1} << (LevelBits * (depth + 1)))};
+        return childLength > extent * std::numeric_limits<FType>::epsilon() * N;
+    }
+
+    // Appends leaf to out, divided into its non-empty child cells (again while those are over-full)
+    void emit(Leaf&& leaf, std::vector<Leaf>& out) const {
+        if(leaf.data.size() <= MaxT || leaf.depth == MaxDepth || !canSplit(leaf.depth)) {
+            out.push_back(std::move(leaf));
+            return;
+        }
+        const std::uint8_t depth{static_cast<std::uint8_t>(leaf.depth + 1)};
+        const Key childSpan{span(depth)};
+        std::vector<Leaf> children(N * N * N);
+        for(std::size_t index{0}; index < leaf.data.size(); index++) {
+            Leaf& child{children[(leaf.codes[index] - leaf.key) / childSpan]};
+            child.data.push_back(std::move(leaf.data[index]));
+            child.codes.push_back(leaf.codes[index]);
+        }
+        for(std::size_t slot{0}; slot < children.size(); slot++) {
+            if(children[slot].data.empty()) continue;
+            children[slot].key = leaf.key + childSpan * slot;
+            children[slot].depth = depth;
+            emit(std::move(children[slot]), out);
+        }
+    }
+
+    // Replaces the over-full leaf at index by its split
+    void splitAt(const std::size_t& index) {
+        std::vector<Leaf> parts;
+        emit(std::move(leaves[index]), parts);
+        leaves[index] = std::move(parts.front());
+        leaves.insert(leaves.begin() + static_cast<std::ptrdiff_t>(index + 1), std::make_move_iterator(parts.begin() + 1), std::make_move_iterator(parts.end()));
+    }
+
+    // Swap-removes the entry at index from leaf
+    static void eraseAt(Leaf& leaf, const std::size_t& index) {
+        leaf.data[index] = std::move(leaf.data.back());
+        leaf.data.pop_back();
+        leaf.codes[index] = leaf.codes.back();
+        leaf.codes.pop_back();
+    }
+
+    // Scans the leaves [first, last): entries still inside their cell get their new key, the ones
+    // that left it are removed and handed back for reinsertion
+    void collect(const std::size_t& first, const std::size_t& last, std::vector<std::shared_ptr<T>>& escaped, std::vector<std::pair<const T*, Key>>& moved, std::mutex& collectMutex) {
+        std::vector<std::shared_ptr<T>> left;
+        std::vector<std::pair<const T*, Key>> settled;
+        for(std::size_t leafIndex{first}; leafIndex < last; leafIndex++) {
+            Leaf& leaf{leaves[leafIndex]};
+            std::size_t index{0};
+            while(index < leaf.data.size()) {
+                auto& data{leaf.data[index]};
+                if(data->m_position == data->m_prevPosition) {
+                    index++;
+                    continue;
+                }
+                data->m_prevPosition = data->m_position;
+                const Key key{inside(box, data->m_position) ? keyOf(data->m_position) : KeyEnd};
+                if(key - leaf.key < span(leaf.depth)) {
+                    leaf.codes[index] = key;
+                    settled.emplace_back(data.get(), key);
+                    index++;
+                } else {
+                    left.push_back(std::move(data));
+                    eraseAt(leaf, index);
+                }
+            }
+        }
+
+        if(!left.empty() || !settled.empty()) {
+            std::lock_guard<std::mutex> guard(collectMutex);
+            escaped.insert(escaped.end(), std::make_move_iterator(left.begin()), std::make_move_iterator(left.end()));
+            moved.insert(moved.end(), settled.begin(), settled.end());
+        }
+    }
+
+    // Grows the box N-fold towards pos so that the old box is exactly one of its child cells, the
+    // caller re-keys every entry afterwards
+    void grow(const glm::vec<3, FType, glm::defaultp>& pos) {
+        const FType halfBl{box.length / 2};
+        glm::vec<3, FType, glm::defaultp> center;
+        for(glm::length_t axis{0}; axis < 3; axis++) {
+            const FType lo{box.center[axis] - halfBl};
+            std::uint8_t slot;
+            if(pos[axis] < lo) slot = N - 1;
+            else if(pos[axis] > box.center[axis] + halfBl) slot = 0;
+            else slot = (pos[axis] < box.center[axis]) ? N / 2 : (N - 1) / 2;
+            center[axis] = lo - box.length * slot + box.length * N / 2;
+        }
+        box = {center, box.length * N};
+    }
+
+    static const bool intersects(const glm::vec<3, FType, glm::defaultp>& center, const FType& range, const BBox& box) {
+        const FType reach{box.length / 2 + range};
+        return std::abs(center.x - box.center.x) <= reach && std::abs(center.y - box.center.y) <= reach && std::abs(center.z - box.center.z) <= reach;
+    }
+
+    BBox box;
+    std::vector<Leaf> leaves;
+
+    // Entity to key of its position as stored, which locates its leaf with one binary search
+    std::unordered_map<const T*, Key> entries;
+};
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef NCUBEDTREE_NODEPOOL_HPP_
+#define NCUBEDTREE_NODEPOOL_HPP_
+
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <new>
+#include <cstddef>
+#include <utility>
+
+// Node allocator that carves nodes out of contiguous slabs and recycles freed nodes. The slabs are
+// only returned when the pool itself is destroyed, which frees a whole tree in one step. Threads are
+// spread over independent stripes so concurrent splits do not contend on a single lock.
+template<typename Node>
+class NodePool {
+public:
+    static constexpr std::size_t Stripes{16};
+
+    explicit NodePool(const std::size_t& nodesPerSlab = 256) :
+        nodesPerSlab(nodesPerSlab == 0 ? 1 : nodesPerSlab) {}
+
+    ~NodePool() {
+        for(auto& stripe : stripes)
+            for(auto& slab : stripe.slabs)
+                ::operator delete(slab, std::align_val_t{alignof(Node)});
+    }
+
+    NodePool(const NodePool&) = delete;
+    NodePool& operator=(const NodePool&) = delete;
+
+    template<typename... Args>
+    Node* create(Args&&... args) {
+        void* slot;
+        {
+            Stripe& stripe{local()};
+            std::lock_guard<std::mutex> lock(stripe.mtx);
+            if(!stripe.freed.empty()) {
+                slot = stripe.freed.back();
+                stripe.freed.pop_back();
+            } else {
+                if(stripe.used == nodesPerSlab || stripe.slabs.empty()) {
+                    stripe.slabs.push_back(::operator new(sizeof(Node) * nodesPerSlab, std::align_val_t{alignof(Node)}));
+                    stripe.used = 0;
+                }
+                slot = static_cast<unsigned char*>(stripe.slabs.back()) + sizeof(Node) * stripe.used++;
+            }
+        }
+        return ::new(slot) Node(std::forward<Args>(args)...);
+    }
+
+    void destroy(Node* node) {
+        node->~Node();
+        Stripe& stripe{local()};
+        std::lock_guard<std::mutex> lock(stripe.mtx);
+        stripe.freed.push_back(node);
+    }
+
+private:
+    struct Stripe {
+        std::mutex mtx;
+        std::vector<void*> slabs;
+        std::vector<void*> freed;
+        std::size_t used{0};
+    };
+
+    Stripe& local() {
+        return stripes[std::hash<std::thread::id>()(std::this_thread::get_id()) % Stripes];
+    }
+
+    const std::size_t nodesPerSlab;
+    Stripe stripes[Stripes];
+};
+
+// Node allocator that forwards to the global heap, for trees that prefer plain new/delete
+template<typename Node>
+class NodeHeap {
+public:
+    template<typename... Args>
+    Node* create(Args&&... args) {
+        return new Node(std::forward<Args>(args)...);
+    }
+
+    void destroy(Node* node) {
+        delete node;
+    }
+};
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef NCUBEDTREE_RANGEKERNEL_HPP_
+#define NCUBEDTREE_RANGEKERNEL_HPP_
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__AVX2__)
+    #include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+    #include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    #include <arm_neon.h>
+#endif
+
+// Squared-distance test over structure-of-arrays positions: calls emit(index) for every point
+// with (p - center)^2 <= range2. The float and double versions run packed compares on whatever
+// vector unit the build targets and finish the remainder with the scalar loop.
+template<typename FType>
+struct RangeKernel {
+    template<typename Emit>
+    static void within(const FType* x, const FType* y, const FType* z, const std::size_t& count, const FType (&center)[3], const FType& range2, Emit&& emit) {
+        scalar(x, y, z, 0, count, center, range2, emit);
+    }
+
+    template<typename Emit>
+    static void scalar(const FType* x, const FType* y, const FType* z, std::size_t first, const std::size_t& count, const FType (&center)[3], const FType& range2, Emit& emit) {
+        for(; first < count; first++) {
+            const FType dx{x[first] - center[0]};
+            const FType dy{y[first] - center[1]};
+            const FType dz{z[first] - center[2]};
+            if(dx * dx + dy * dy + dz * dz <= range2) emit(first);
+        }
+    }
+
+    // Calls emit for the lanes set in mask, lowest index first
+    template<typename Emit>
+    static void emitMask(std::uint32_t mask, const std::size_t& base, Emit& emit) {
+        while(mask != 0) {
+            std::size_t lane{0};
+            while(((mask >> lane) & 1u) == 0) lane++;
+            emit(base + lane);
+            mask &= mask - 1;
+        }
+    }
+};
+
+template<>
+template<typename Emit>
+inline void RangeKernel<float>::within(const float* x, const float* y, const float* z, const std::size_t& count, const float (&center)[3], const float& range2, Emit&& emit) {
+    std::size_t i{0};
+#if defined(__AVX2__)
+    const __m256 cx{_mm256_set1_ps(center[0])}, cy{_mm256_set1_ps(center[1])}, cz{_mm256_set1_ps(center[2])}, r2{_mm256_set1_ps(range2)};
+    for(; i + 8 <= count; i += 8) {
+        const __m256 dx{_mm256_sub_ps(_mm256_loadu_ps(x + i), cx)};
+        const __m256 dy{_mm256_sub_ps(_mm256_loadu_ps(y + i), cy)};
+        const __m256 dz{_mm256_sub_ps(_mm256_loadu_ps(z + i), cz)};
+        const __m256 d2{_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz))};
+        emitMask(static_cast<std::uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(d2, r2, _CMP_LE_OQ))), i, emit);
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    const __m128 cx{_mm_set1_ps(center[0])}, cy{_mm_set1_ps(center[1])}, cz{_mm_set1_ps(center[2])}, r2{_mm_set1_ps(range2)};
+    for(; i + 4 <= count; i += 4) {
+        const __m128 dx{_mm_sub_ps(_mm_loadu_ps(x + i), cx)};
+        const __m128 dy{_mm_sub_ps(_mm_loadu_ps(y + i), cy)};
+        const __m128 dz{_mm_sub_ps(_mm_loadu_ps(z + i), cz)};
+        const __m128 d2{_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz))};
+        emitMask(static_cast<std::uint32_t>(_mm_movemask_ps(_mm_cmple_ps(d2, r2))), i, emit);
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    const float32x4_t cx{vdupq_n_f32(center[0])}, cy{vdupq_n_f32(center[1])}, cz{vdupq_n_f32(center[2])}, r2{vdupq_n_f32(range2)};
+    const uint32x4_t lanes{1, 2, 4, 8};
+    for(; i + 4 <= count; i += 4) {
+        const float32x4_t dx{vsubq_f32(vld1q_f32(x + i), cx)};
+        const float32x4_t dy{vsubq_f32(vld1q_f32(y + i), cy)};
+        const float32x4_t dz{vsubq_f32(vld1q_f32(z + i), cz)};
+        const float32x4_t d2{vfmaq_f32(vfmaq_f32(vmulq_f32(dx, dx), dy, dy), dz, dz)};
+        emitMask(vaddvq_u32(vandq_u32(vcleq_f32(d2, r2), lanes)), i, emit);
+    }
+#endif
+    scalar(x, y, z, i, count, center, range2, emit);
+}
+
+template<>
+template<typename Emit>
+inline void RangeKernel<double>::within(const double* x, const double* y, const double* z, const std::size_t& count, const double (&center)[3], const double& range2, Emit&& emit) {
+    std::size_t i{0};
+#if defined(__AVX2__)
+    const __m256d cx{_mm256_set1_pd(center[0])}, cy{_mm256_set1_pd(center[1])}, cz{_mm256_set1_pd(center[2])}, r2{_mm256_set1_pd(range2)};
+    for(; i + 4 <= count; i += 4) {
+        const __m256d dx{_mm256_sub_pd(_mm256_loadu_pd(x + i), cx)};
+        const __m256d dy{_mm256_sub_pd(_mm256_loadu_pd(y + i), cy)};
+        const __m256d dz{_mm256_sub_pd(_mm256_loadu_pd(z + i), cz)};
+        const __m256d d2{_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)), _mm256_mul_pd(dz, dz))};
+        emitMask(static_cast<std::uint32_t>(_mm256_movemask_pd(_mm256_cmp_pd(d2, r2, _CMP_LE_OQ))), i, emit);
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    const __m128d cx{_mm_set1_pd(center[0])}, cy{_mm_set1_pd(center[1])}, cz{_mm_set1_pd(center[2])}, r2{_mm_set1_pd(range2)};
+    for(; i + 2 <= count; i += 2) {
+        const __m128d dx{_mm_sub_pd(_mm_loadu_pd(x + i), cx)};
+        const __m128d dy{_mm_sub_pd(_mm_loadu_pd(y + i), cy)};
+        const __m128d dz{_mm_sub_pd(_mm_loadu_pd(z + i), cz)};
+        const __m128d d2{_mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy)), _mm_mul_pd(dz, dz))};
+        emitMask(static_cast<std::uint32_t>(_mm_movemask_pd(_mm_cmple_pd(d2, r2))), i, emit);
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    const float64x2_t cx{vdupq_n_f64(center[0])}, cy{vdupq_n_f64(center[1])}, cz{vdupq_n_f64(center[2])}, r2{vdupq_n_f64(range2)};
+    const uint64x2_t lanes{1, 2};
+    for(; i + 2 <= count; i += 2) {
+        const float64x2_t dx{vsubq_f64(vld1q_f64(x + i), cx)};
+        const float64x2_t dy{vsubq_f64(vld1q_f64(y + i), cy)};
+        const float64x2_t dz{vsubq_f64(vld1q_f64(z + i), cz)};
+        const float64x2_t d2{vfmaq_f64(vfmaq_f64(vmulq_f64(dx, dx), dy, dy), dz, dz)};
+        emitMask(static_cast<std::uint32_t>(vaddvq_u64(vandq_u64(vcleq_f64(d2, r2), lanes))), i, emit);
+    }
+#endif
+    scalar(x, y, z, i, count, center, range2, emit);
+}
+
+#endif
@@ -0,0 +1,253 @@
+#ifndef NCUBEDTREE_SHARDEDCUBETREE_HPP_
+#define NCUBEDTREE_SHARDEDCUBETREE_HPP_
+
+#include <vector>
+#include <functional>
+#include <unordered_map>
+#include <algorithm>
+#include <span>
+#include <cstdint>
+#include <stdexcept>
+#include "CubeTree.hpp"
+
+// One process's share of a world split across several processes. The world box is cut into the
+// N^3 (N^2 in 2D) top-level cells a CubeTree root over it would have, every cell has an owner and each process
+// keeps a CubeTree for every cell it owns. Entities that move into a cell owned elsewhere are
+// taken out and handed to send() in one batch per owner, receive() takes in the batches of the
+// others. Range queries are answered locally and name the other owners they reach, forwarding
+// them is up to the transport. Entities outside the world box belong to the nearest edge cell.
+// Not safe for concurrent use, the trees themselves are updated on the pool
+template<std::uint8_t N, std::uint16_t MaxT, typename T, typename FType = double, template<typename> class NodeAllocator = NodePool, typename Options = CubeTreeOptions, typename Traits = EntityTraits<T>>
+class ShardedCubeTree {
+public:
+    typedef CubeTree<N, MaxT, T, FType, NodeAllocator, Options, Traits> Tree;
+    typedef typename Tree::Handle Handle;
+    typedef typename Tree::BBox BBox;
+    typedef std::uint32_t Owner;
+
+    // Called with the owner of a cell and the owner-less entities moving to it
+    typedef std::function<void(const Owner&, std::vector<Handle>&&)> Send;
+
+    // ownerOf(i, j, k) assigns the top-level cell [i][j][k] of world to a process
+    ShardedCubeTree(const BBox& world, const Owner& self, const std::function<Owner(std::uint8_t, std::uint8_t, std::uint8_t)>& ownerOf, Send send) :
+        world(world), self(self), send(std::move(send)) {
+        for(std::uint8_t i{0}; i < N; i++)
+            for(std::uint8_t j{0}; j < N; j++)
+                for(std::uint8_t k{0}; k < Tree::NZ; k++) owners[i][j][k] = ownerOf(i, j, k);
+    }
+
+    ~ShardedCubeTree() {
+        for(std::uint8_t i{0}; i < N; i++)
+            for(std::uint8_t j{0}; j < N; j++)
+                for(std::uint8_t k{0}; k < Tree::NZ; k++) delete trees[i][j][k];
+    }
+
+    ShardedCubeTree(const ShardedCubeTree&) = delete;
+    ShardedCubeTree& operator=(const ShardedCubeTree&) = delete;
+
+    const Owner& ownerAt(const std::uint8_t& i, const std::uint8_t& j, const std::uint8_t& k) const {
+        return owners[i][j][k];
+    }
+
+    // Box of the top-level cell [i][j][k]
+    const BBox cellBox(const std::uint8_t& i, const std::uint8_t& j, const std::uint8_t& k) const {
+        const FType cellLength{world.length / N};
+        const FType halfBl{world.length / 2};
+        return {
+            {
+                world.center.x - halfBl + cellLength * (static_cast<FType>(i) + static_cast<FType>(0.5)),
+                world.center.y - halfBl + cellLength * (static_cast<FType>(j) + static_cast<FType>(0.5)),
+                (Tree::Axes == 2) ? world.center.z : world.center.z - halfBl + cellLength * (static_cast<FType>(k) + static_cast<FType>(0.5))
+            },
+            cellLength
+        };
+    }
+
+    // Tree of a cell this process owns, nullptr while nothing was stored there
+    Tree* treeAt(const std::uint8_t& i, const std::uint8_t& j, const std::uint8_t& k) const {
+        return trees[i][j][k];
+    }
+
+    // Function to insert an entity, stored here when this process owns its cell and queued for
+    // the owner otherwise. Queued entities go out with the next flush or update
+    void insert(const Handle& entity) {
+        const Slot slot{slotOf(Traits::position(entity))};
+        if(owners[slot.i][slot.j][slot.k] == self) store(slot, entity);
+        else outbox[owners[slot.i][slot.j][slot.k]].push_back(entity);
+    }
+
+    // Function to take in entities another process sent, ones whose cell changed hands meanwhile
+    // are passed on again
+    void receive(std::span<const Handle> entities) {
+        for(const auto& entity : entities) insert(entity);
+        flush();
+    }
+
+    // Function to remove an entity stored here, returns false if it is not
+    bool remove(const Handle& entity) {
+        Tree* tree{treeOf(entity)};
+        return tree != nullptr && tree->remove(entity);
+    }
+
+    // Function to queue a moved entity for the next update, only needed with Options::markedMoves.
+    // Nothing happens when it is not stored here
+    void markMoved(const Handle& entity) requires Options::markedMoves {
+        Tree* tree{treeOf(entity)};
+        if(tree != nullptr) tree->markMoved(entity);
+    }
+
+    // Function to send every queued entity, one batch per owner
+    void flush() {
+        for(auto& [owner, batch] : outbox) {
+            if(!batch.empty()) send(owner, std::move(batch));
+        }
+        outbox.clear();
+    }
+
+    void update(const std::uint16_t& threads) {
+        update(ThreadPool::shared(), threads);
+    }
+
+    // Updates every local tree on the pool. The entities that crossed into another cell are picked
+    // out while each tree finds its movers, so with Options::markedMoves only marked entities are
+    // looked at, and go into the local tree of that cell or into the batch for its owner, sent at the end
+    void update(ThreadPool& pool, const std::uint16_t& threads) {
+        std::vector<Handle> crossed;
+        forEachTree([&](const Slot& slot, Tree* tree) {
+            const auto leaves{[this, &slot](const Handle& entity) {
+                const Slot now{slotOf(Traits::position(entity))};
+                return now.i != slot.i || now.j != slot.j || now.k != slot.k;
+            }};
+            try {
+                trees[slot.i][slot.j][slot.k] = Tree::update(pool, threads, tree, leaves, crossed);
+            } catch(...) {
+                // The crossers are out of the tree already, they must not get lost with it
+                route(crossed);
+                throw;
+            }
+            route(crossed);
+        });
+        flush();
+    }
+
+    // Function to hand cell [i][j][k] to another owner. When it was ours its entities are queued
+    // for the new owner and its tree is released
+    void reassign(const std::uint8_t& i, const std::uint8_t& j, const std::uint8_t& k, const Owner& owner) {
+        const Owner previous{owners[i][j][k]};
+        owners[i][j][k] = owner;
+        if(previous != self || owner == self || trees[i][j][k] == nullptr) return;
+        std::vector<Handle>& batch{outbox[owner]};
+        trees[i][j][k]->forEach([&batch](Handle& entity) { batch.push_back(entity); });
+        delete trees[i][j][k];
+        trees[i][j][k] = nullptr;
+    }
+
+    // Function to call visitor with every local entity within range of center and remote(owner)
+    // once for every other owner of a cell the query reaches
+    template<typename F, typename R> requires std::invocable<F&, const Handle&> && std::invocable<R&, const Owner&>
+    void queryRange(const glm::vec<3, FType, glm::defaultp>& center, const FType& range, F&& visitor, R&& remote) {
+        std::vector<Owner> reached;
+        forEachCellWithin(center, range, [&](const Slot& slot) {
+            const Owner& owner{owners[slot.i][slot.j][slot.k]};
+            if(owner != self) {
+                if(std::find(reached.begin(), reached.end(), owner) == reached.end()) reached.push_back(owner);
+            } else if(trees[slot.i][slot.j][slot.k] != nullptr) {
+                trees[slot.i][slot.j][slot.k]->queryRange(center, range, visitor);
+            }
+        });
+        for(const Owner& owner : reached) remote(owner);
+    }
+
+    // Function to list the owners, this one included, of the cells within range of center
+    std::vector<Owner> ownersWithin(const glm::vec<3, FType, glm::defaultp>& center, const FType& range) const {
+        std::vector<Owner> reached;
+        forEachCellWithin(center, range, [&](const Slot& slot) {
+            const Owner& owner{owners[slot.i][slot.j][slot.k]};
+            if(std::find(reached.begin(), reached.end(), owner) == reached.end()) reached.push_back(owner);
+        });
+        return reached;
+    }
+
+private:
+    typedef struct Slot {
+        std::uint8_t i, j, k;
+    } Slot;
+
+    const Slot slotOf(const glm::vec<3, FType, glm::defaultp>& pos) const {
+        return {Tree::childSlot(pos.x, world.center.x, world.length), Tree::childSlot(pos.y, world.center.y, world.length), (Tree::Axes == 2) ? std::uint8_t{0} : Tree::childSlot(pos.z, world.center.z, world.length)};
+    }
+
+    // Stores entity in the local tree of its cell, creating the tree on first use. An edge cell's
+    // first entity may lie outside the world, the tree then starts out as large as needed
+    void store(const Slot& slot, const Handle& entity) {
+        Tree*& tree{trees[slot.i][slot.j][slot.k]};
+        if(tree == nullptr) {
+            BBox box{cellBox(slot.i, slot.j, slot.k)};
+            while(!Tree::fits(box, entity)) box.length *= 2;
+            tree = new Tree(box, entity);
+        }
+        else tree = tree->insert(entity);
+    }
+
+    // Local tree holding entity, looked for in the cells of its position and of where it last settled first
+    Tree* treeOf(const Handle& entity) const {
+        for(const Slot& slot : {slotOf(Traits::position(entity)), slotOf(Traits::prevPosition(entity))}) {
+            Tree* tree{trees[slot.i][slot.j][slot.k]};
+            if(tree != nullptr && tree->findNode(entity) != nullptr) return tree;
+        }
+        for(auto& row : trees)
+            for(auto& column : row)
+                for(Tree* other : column)
+                    if(other != nullptr && other->findNode(entity) != nullptr) return other;
+        return nullptr;
+    }
+
+    // Stores or queues entities taken out of another cell's tree and empties the list
+    void route(std::vector<Handle>& entities) {
+        for(auto& entity : entities) insert(entity);
+        entities.clear();
+    }
+
+    template<typename F>
+    void forEachTree(const F& func) {
+        for(std::uint8_t i{0}; i < N; i++)
+            for(std::uint8_t j{0}; j < N; j++)
+                for(std::uint8_t k{0}; k < Tree::NZ; k++)
+                    if(trees[i][j][k] != nullptr) func(Slot{i, j, k}, trees[i][j][k]);
+    }
+
+    // Calls func with every cell whose box comes within range of center, entities outside the
+    // world sit in edge cells so those are extended outwards
+    template<typename F>
+    void forEachCellWithin(const glm::vec<3, FType, glm::defaultp>& center, const FType& range, const F& func) const {
+        const Slot lo{slotOf(center - glm::vec<3, FType, glm::defaultp>(range))};
+        const Slot hi{slotOf(center + glm::vec<3, FType, glm::defaultp>(range))};
+        for(std::uint8_t i{lo.i}; i <= hi.i; i++) {
+            for(std::uint8_t j{lo.j}; j <= hi.j; j++) {
+                for(std::uint8_t k{lo.k}; k <= hi.k; k++) {
+                    const BBox box{cellBox(i, j, k)};
+                    FType d2{0};
+                    for(glm::length_t axis{0}; axis < Tree::Axes; axis++) {
+                        const std::uint8_t slot{(axis == 0) ? i : ((axis == 1) ? j : k)};
+                        FType offset{std::abs(center[axis] - box.center[axis]) - box.length / 2};
+                        // An edge cell reaches as far out of the world as its entities do
+                        if((slot == 0 && center[axis] < box.center[axis]) || (slot == N - 1 && center[axis] > box.center[axis])) offset = std::min(offset, FType{0});
+                        if(offset > 0) d2 += offset * offset;
+                    }
+                    if(d2 <= range * range) func(Slot{i, j, k});
+                }
+            }
+        }
+    }
+
+    BBox world;
+    Owner self;
+    Send send;
+    Owner owners[N][N][Tree::NZ]{};
+    Tree* trees[N][N][Tree::NZ]{};
+
+    // Entities waiting to be sent, by owner
+    std::unordered_map<Owner, std::vector<Handle>> outbox;
+};
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef NCUBEDTREE_SMALLVECTOR_HPP_
+#define NCUBEDTREE_SMALLVECTOR_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <memory>
+#include <utility>
+
+// Vector that keeps up to Inline elements inside the object itself and only moves to the heap
+// once it grows past that. Offers the subset of std::vector the tree nodes use
+template<typename E, std::size_t Inline>
+class SmallVector {
+public:
+    typedef E value_type;
+    typedef E* iterator;
+    typedef const E* const_iterator;
+
+    SmallVector() = default;
+
+    SmallVector(SmallVector&& other) noexcept {
+        take(other);
+    }
+
+    SmallVector& operator=(SmallVector&& other) noexcept {
+        if(this != &other) {
+            release();
+            take(other);
+        }
+        return *this;
+    }
+
+    SmallVector(const SmallVector&) = delete;
+    SmallVector& operator=(const SmallVector&) = delete;
+
+    ~SmallVector() {
+        release();
+    }
+
+    std::size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    E* begin() { return items(); }
+    E* end() { return items() + count; }
+    const E* begin() const { return items(); }
+    const E* end() const { return items() + count; }
+
+    E& operator[](const std::size_t& index) { return items()[index]; }
+    const E& operator[](const std::size_t& index) const { return items()[index]; }
+    E& back() { return items()[count - 1]; }
+    const E& back() const { return items()[count - 1]; }
+
+    void push_back(const E& value) {
+        if(count == capacity) reallocate(capacity * 2);
+        ::new(items() + count) E(value);
+        count++;
+    }
+
+    void push_back(E&& value) {
+        if(count == capacity) reallocate(capacity * 2);
+        ::new(items() + count) E(std::move(value));
+        count++;
+    }
+
+    void pop_back() {
+        std::destroy_at(items() + --count);
+    }
+
+    void clear() {
+        std::destroy(begin(), end());
+        count = 0;
+    }
+
+    void reserve(const std::size_t& wanted) {
+        if(wanted > capacity) reallocate(wanted);
+    }
+
+    // Returns to the inline buffer when the elements fit into it, otherwise trims the heap block
+    void shrink_to_fit() {
+        if(heap != nullptr && count < capacity) reallocate(count);
+    }
+
+private:
+    static constexpr std::size_t Capacity{(Inline == 0) ? 1 : Inline};
+
+    E* items() { return (heap != nullptr) ? heap : reinterpret_cast<E*>(buffer); }
+    const E* items() const { return (heap != nullptr) ? heap : reinterpret_cast<const E*>(buffer); }
+
+    // Moves the elements into storage for at least wanted of them, inline when they fit
+    void reallocate(std::size_t wanted) {
+        if(wanted < count) wanted = count;
+        E* target{(wanted <= Capacity) ? reinterpret_cast<E*>(buffer) : static_cast<E*>(::operator new(sizeof(E) * wanted, std::align_val_t{alignof(E)}))};
+        E* source{items()};
+        if(target == source) return;
+        std::uninitialized_move(source, source + count, target);
+        std::destroy(source, source + count);
+        if(heap != nullptr) ::operator delete(heap, std::align_val_t{alignof(E)});
+        heap = (wanted <= Capacity) ? nullptr : target;
+        capacity = static_cast<std::uint32_t>((wanted <= Capacity) ? Capacity : wanted);
+    }
+
+    void take(SmallVector& other) {
+        if(other.heap != nullptr) {
+            heap = other.heap;
+            capacity = other.capacity;
+            other.heap = nullptr;
+        } else {
+            std::uninitialized_move(other.begin(), other.end(), reinterpret_cast<E*>(buffer));
+            std::destroy(other.begin(), other.end());
+            capacity = static_cast<std::uint32_t>(Capacity);
+        }
+        count = other.count;
+        other.count = 0;
+        other.capacity = static_cast<std::uint32_t>(Capacity);
+    }
+
+    void release() {
+        clear();
+        if(heap != nullptr) ::operator delete(heap, std::align_val_t{alignof(E)});
+        heap = nullptr;
+        capacity = static_cast<std::uint32_t>(Capacity);
+    }
+
+    E* heap{nullptr};
+    std::uint32_t count{0};
+    std::uint32_t capacity{static_cast<std::uint32_t>(Capacity)};
+    alignas(E) unsigned char buffer[sizeof(E) * Capacity];
+};
+
+#endif
@@ -0,0 +1,201 @@
+#ifndef NCUBEDTREE_THREADPOOL_HPP_
+#define NCUBEDTREE_THREADPOOL_HPP_
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <cstdint>
+
+// Persistent work-stealing executor. Every worker owns a deque: it pushes and pops its own
+// work at the back and steals from the front of the other deques when it runs dry.
+class ThreadPool {
+public:
+    typedef std::function<void()> Task;
+
+    // Groups a set of tasks so they can be waited on together. The calling thread counts towards
+    // `limit`: run() spawns onto the pool while fewer than limit - 1 tasks of the group are in
+    // flight and runs inline otherwise, so a limit of 1 keeps all of the work on the caller
+    class TaskGroup {
+    public:
+        TaskGroup(ThreadPool& pool, const std::uint16_t& limit) :
+            pool(pool), limit(limit == 0 ? 1 : limit), inFlight(0) {}
+
+        ~TaskGroup() {
+            wait();
+        }
+
+        template<typename F>
+        void run(F&& func) {
+            std::uint16_t current{inFlight.load(std::memory_order_relaxed)};
+            while(current + 1 < limit) {
+                if(inFlight.compare_exchange_weak(current, current + 1, std::memory_order_acq_rel)) {
+                    pool.submit([this, func{std::forward<F>(func)}]() mutable {
+                        func();
+                        finish();
+                    });
+                    return;
+                }
+            }
+            func();
+        }
+
+        // Blocks until every spawned task of the group finished, helping with queued work meanwhile
+        void wait() {
+            while(inFlight.load(std::memory_order_acquire) != 0) {
+                if(!pool.runPending()) pool.sleepUntil([this]() { return inFlight.load(std::memory_order_acquire) == 0; });
+            }
+        }
+
+        const std::uint16_t& concurrency() const {
+            return limit;
+        }
+
+    private:
+        void finish() {
+            // The waiter may return and destroy the group as soon as the count drops, copy the pool first
+            ThreadPool& owner{pool};
+            if(inFlight.fetch_sub(1, std::memory_order_acq_rel) == 1) owner.wakeAll();
+        }
+
+        ThreadPool& pool;
+        const std::uint16_t limit;
+        std::atomic<std::uint16_t> inFlight;
+    };
+
+    explicit ThreadPool(const std::uint16_t& threads = defaultThreads()) :
+        queues(threads == 0 ? 1 : threads), queued(0), sleepers(0), stopping(false) {
+        for(auto& queue : queues) queue.reset(new Queue());
+        workers.reserve(queues.size());
+        for(std::size_t i{0}; i < queues.size(); i++) workers.emplace_back([this, i]() { workerLoop(i); });
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMtx);
+            stopping = true;
+        }
+        sleepCv.notify_all();
+        for(auto& worker : workers) worker.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Process-wide pool used when a caller does not pass its own
+    static ThreadPool& shared() {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    static std::uint16_t defaultThreads() {
+        const unsigned int hw{std::thread::hardware_concurrency()};
+        return static_cast<std::uint16_t>(hw == 0 ? 1 : hw);
+    }
+
+    std::uint16_t size() const {
+        return static_cast<std::uint16_t>(queues.size());
+    }
+
+    void submit(Task task) {
+        const std::size_t index{(current.pool == this) ? current.index : nextQueue.fetch_add(1, std::memory_order_relaxed) % queues.size()};
+        queued.fetch_add(1, std::memory_order_seq_cst);
+        {
+            std::lock_guard<std::mutex> lock(queues[index]->mtx);
+            queues[index]->tasks.push_back(std::move(task));
+        }
+        if(sleepers.load(std::memory_order_seq_cst) != 0) {
+            { std::lock_guard<std::mutex> lock(sleepMtx); }
+            sleepCv.notify_one();
+        }
+    }
+
+    // Runs one queued task on the calling thread, returns false if there was nothing to run
+    bool runPending() {
+        Task task;
+        if(!take(task)) return false;
+        task();
+        return true;
+    }
+
+private:
+    struct Queue {
+        std::mutex mtx;
+        std::deque<Task> tasks;
+    };
+
+    struct Current {
+        ThreadPool* pool;
+        std::size_t index;
+    };
+
+    bool take(Task& task) {
+        if(queued.load(std::memory_order_acquire) == 0) return false;
+        const std::size_t home{(current.pool == this) ? current.index : 0};
+        // Own queue first, newest task (depth first keeps the working set warm)
+        {
+            Queue& queue{*queues[home]};
+            std::lock_guard<std::mutex> lock(queue.mtx);
+            if(!queue.tasks.empty()) {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+                queued.fetch_sub(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        // Then steal the oldest task of another worker, which is usually the biggest subtree
+        for(std::size_t offset{1}; offset < queues.size(); offset++) {
+            Queue& queue{*queues[(home + offset) % queues.size()]};
+            std::lock_guard<std::mutex> lock(queue.mtx);
+            if(!queue.tasks.empty()) {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+                queued.fetch_sub(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    template<typename Pred>
+    void sleepUntil(const Pred& done) {
+        std::unique_lock<std::mutex> lock(sleepMtx);
+        sleepers.fetch_add(1, std::memory_order_seq_cst);
+        sleepCv.wait(lock, [&]() { return stopping || done() || queued.load(std::memory_order_seq_cst) != 0; });
+        sleepers.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void wakeAll() {
+        { std::lock_guard<std::mutex> lock(sleepMtx); }
+        sleepCv.notify_all();
+    }
+
+    void workerLoop(const std::size_t& index) {
+        current = {this, index};
+        while(true) {
+            if(runPending()) continue;
+            if(stopping) break;
+            sleepUntil([]() { return false; });
+            if(stopping && queued.load(std::memory_order_acquire) == 0) break;
+        }
+    }
+
+    static thread_local Current current;
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<std::size_t> nextQueue{0};
+    std::atomic<std::size_t> queued;
+    std::atomic<std::size_t> sleepers;
+    std::mutex sleepMtx;
+    std::condition_variable sleepCv;
+    std::atomic<bool> stopping;
+};
+
+inline thread_local ThreadPool::Current ThreadPool::current{nullptr, 0};
+
+#endif
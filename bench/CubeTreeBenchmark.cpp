@@ -0,0 +1,210 @@
+// Google Benchmark suite for CubeTree: insert throughput, update at several mover fractions,
+// queryRange latency at several radii and forEachAsync scaling with the thread limit, swept over
+// N, MaxT and FType and over uniform, clustered and moving-swarm distributions, in 3D and on a
+// plane with 2D trees.
+//
+// Build against an installed Google Benchmark, for example
+//     g++ -std=c++20 -O2 -I.. CubeTreeBenchmark.cpp -o CubeTreeBenchmark -lbenchmark -pthread
+// Results are written as JSON to CubeTreeBenchmark.json unless --benchmark_out is given, the
+// usual --benchmark_filter and --benchmark_repetitions flags apply.
+
+#include <benchmark/benchmark.h>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "CubeTree.hpp"
+
+enum class Distribution { Uniform, Clustered, Swarm };
+
+template<typename FType>
+struct Entity {
+    std::string m_name;
+    glm::vec<3, FType, glm::defaultp> m_position;
+    glm::vec<3, FType, glm::defaultp> m_prevPosition;
+    FType m_radius;
+    std::uint32_t flock;
+};
+
+// Options of the planar runs
+struct Planar : CubeTreeOptions {
+    static constexpr std::uint8_t dimensions{2};
+};
+
+template<std::uint8_t N, std::uint16_t MaxT, typename FType, Distribution D, typename Options = CubeTreeOptions>
+struct Params {
+    typedef Entity<FType> T;
+    typedef CubeTree<N, MaxT, T, FType, NodePool, Options> Tree;
+    typedef glm::vec<3, FType, glm::defaultp> Vec;
+
+    static constexpr FType WorldLength{200};
+    static constexpr std::uint32_t Count{1 << 14};
+    static constexpr std::uint32_t Flocks{8};
+
+    static std::string name() {
+        static const char* distributions[]{"uniform", "clustered", "swarm"};
+        return "N" + std::to_string(N) + "/MaxT" + std::to_string(MaxT) + "/" + (sizeof(FType) == sizeof(float) ? "float" : "double") + "/" + distributions[static_cast<int>(D)] + (Options::dimensions == 2 ? "/2d" : "");
+    }
+
+    // Function to generate the entities of the distribution, always the same ones
+    static std::vector<std::shared_ptr<T>> entities() {
+        std::mt19937 rng(7);
+        std::uniform_real_distribution<FType> world(-WorldLength / 2 * FType(0.95), WorldLength / 2 * FType(0.95));
+        std::normal_distribution<FType> spread(0, (D == Distribution::Swarm) ? 3 : 8);
+        std::vector<Vec> centers;
+        for(std::uint32_t i{0}; i < Flocks * 2; i++) centers.push_back({world(rng) / 2, world(rng) / 2, world(rng) / 2});
+
+        std::vector<std::shared_ptr<T>> all;
+        all.reserve(Count);
+        for(std::uint32_t i{0}; i < Count; i++) {
+            auto entity{std::make_shared<T>()};
+            entity->flock = i % ((D == Distribution::Swarm) ? Flocks : Flocks * 2);
+            if(D == Distribution::Uniform) entity->m_position = {world(rng), world(rng), world(rng)};
+            else entity->m_position = centers[entity->flock] + Vec{spread(rng), spread(rng), spread(rng)};
+            if(Options::dimensions == 2) entity->m_position.z = 0;
+            entity->m_prevPosition = entity->m_position;
+            entity->m_radius = FType(0.5);
+            all.push_back(std::move(entity));
+        }
+        return all;
+    }
+
+    static Tree* build(const std::vector<std::shared_ptr<T>>& all) {
+        Tree* root{new Tree({{0, 0, 0}, WorldLength}, all[0])};
+        for(std::size_t i{1}; i < all.size(); i++) root = root->insert(all[i]);
+        return root;
+    }
+
+    // Function to move every `stride`-th entity, a swarm moves flock by flock and reverses every
+    // other tick so the tree does not drift out of its box
+    static void move(std::vector<std::shared_ptr<T>>& all, const std::size_t& stride, const std::uint32_t& tick, std::mt19937& rng) {
+        std::uniform_real_distribution<FType> jitter(-1, 1);
+        const FType sign{(tick % 2 == 0) ? FType(1) : FType(-1)};
+        const FType lift{(Options::dimensions == 2) ? FType(0) : FType(1)};
+        for(std::size_t i{tick % stride}; i < all.size(); i += stride) {
+            T& entity{*all[i]};
+            if(D == Distribution::Swarm) {
+                const FType phase{static_cast<FType>(entity.flock)};
+                entity.m_position += sign * Vec{std::cos(phase), std::sin(phase), FType(0.5) * lift} * FType(2) + Vec{jitter(rng), jitter(rng), jitter(rng) * lift} * FType(0.1);
+            } else {
+                entity.m_position += Vec{jitter(rng), jitter(rng), jitter(rng) * lift} * FType(2);
+            }
+        }
+    }
+};
+
+template<typename P>
+void insertBenchmark(benchmark::State& state) {
+    const auto all{P::entities()};
+    for(auto _ : state) {
+        typename P::Tree* root{P::build(all)};
+        state.PauseTiming();
+        delete root;
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations()) * all.size());
+}
+
+// Argument is the percentage of entities that move each tick
+template<typename P>
+void updateBenchmark(benchmark::State& state) {
+    auto all{P::entities()};
+    typename P::Tree* root{P::build(all)};
+    const std::size_t stride{static_cast<std::size_t>(100 / state.range(0))};
+    const std::uint16_t threads{static_cast<std::uint16_t>(std::thread::hardware_concurrency())};
+    std::mt19937 rng(11);
+    std::uint32_t tick{0};
+    for(auto _ : state) {
+        state.PauseTiming();
+        P::move(all, stride, tick++, rng);
+        state.ResumeTiming();
+        root = P::Tree::update(threads, root);
+    }
+    state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations()) * (all.size() / stride));
+    delete root;
+}
+
+// Argument is the query radius
+template<typename P>
+void queryRangeBenchmark(benchmark::State& state) {
+    const auto all{P::entities()};
+    typename P::Tree* root{P::build(all)};
+    const auto range{static_cast<typename P::Vec::value_type>(state.range(0))};
+    std::size_t next{0}, found{0};
+    for(auto _ : state) {
+        root->queryRange(all[next]->m_position, range, [&found](const std::shared_ptr<typename P::T>&) { found++; });
+        next = (next + 7919) % all.size();
+    }
+    benchmark::DoNotOptimize(found);
+    state.counters["found"] = benchmark::Counter(static_cast<double>(found), benchmark::Counter::kAvgIterations);
+    delete root;
+}
+
+// Argument is the thread limit handed to forEachAsync
+template<typename P>
+void forEachAsyncBenchmark(benchmark::State& state) {
+    const auto all{P::entities()};
+    typename P::Tree* root{P::build(all)};
+    const std::uint16_t threads{static_cast<std::uint16_t>(state.range(0))};
+    for(auto _ : state) {
+        root->forEachAsync(threads, [](std::shared_ptr<typename P::T>& entity) {
+            auto length{glm::length(entity->m_position)};
+            benchmark::DoNotOptimize(length);
+            return true;
+        });
+    }
+    state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations()) * all.size());
+    delete root;
+}
+
+template<typename P>
+void registerBenchmarks() {
+    benchmark::RegisterBenchmark(("insert/" + P::name()).c_str(), insertBenchmark<P>)->Unit(benchmark::kMillisecond);
+    benchmark::RegisterBenchmark(("update/" + P::name()).c_str(), updateBenchmark<P>)->Arg(1)->Arg(10)->Arg(25)->Arg(50)->Unit(benchmark::kMillisecond)->UseRealTime();
+    benchmark::RegisterBenchmark(("queryRange/" + P::name()).c_str(), queryRangeBenchmark<P>)->Arg(5)->Arg(20)->Arg(50)->Unit(benchmark::kMicrosecond);
+    benchmark::RegisterBenchmark(("forEachAsync/" + P::name()).c_str(), forEachAsyncBenchmark<P>)->RangeMultiplier(2)->Range(1, 8)->Unit(benchmark::kMillisecond)->UseRealTime();
+}
+
+template<std::uint8_t N, std::uint16_t MaxT, typename FType, typename Options = CubeTreeOptions>
+void registerDistributions() {
+    registerBenchmarks<Params<N, MaxT, FType, Distribution::Uniform, Options>>();
+    registerBenchmarks<Params<N, MaxT, FType, Distribution::Clustered, Options>>();
+    registerBenchmarks<Params<N, MaxT, FType, Distribution::Swarm, Options>>();
+}
+
+template<std::uint8_t N>
+void registerSweep() {
+    registerDistributions<N, 8, float>();
+    registerDistributions<N, 8, double>();
+    registerDistributions<N, 32, float>();
+    registerDistributions<N, 32, double>();
+    registerDistributions<N, 8, float, Planar>();
+    registerDistributions<N, 32, float, Planar>();
+}
+
+int main(int argc, char** argv) {
+    registerSweep<2>();
+    registerSweep<4>();
+    registerSweep<8>();
+
+    // Default to a JSON results file next to the console output
+    std::vector<char*> args(argv, argv + argc);
+    std::string out{"--benchmark_out=CubeTreeBenchmark.json"}, format{"--benchmark_out_format=json"};
+    bool hasOut{false};
+    for(int i{1}; i < argc; i++) {
+        if(std::string(argv[i]).rfind("--benchmark_out=", 0) == 0) hasOut = true;
+    }
+    if(!hasOut) {
+        args.push_back(out.data());
+        args.push_back(format.data());
+    }
+    int count{static_cast<int>(args.size())};
+    benchmark::Initialize(&count, args.data());
+    if(benchmark::ReportUnrecognizedArguments(count, args.data())) return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}